@@ -4,24 +4,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/sysinfo.h>
+#include <string.h>
 #include "perf_events.h"
+#include "energy.h"
+#include "benchmarking.h"
 
 
 #define cgroup_path "/sys/fs/cgroup/benchmarking"
 
-struct cgroup_stats { 
-    unsigned long long cputime; // in microseconds
-    long long maxRSS; // in bytes
-    unsigned long io_op;
-    unsigned long long cycles;
-    long long estimated_energy; // in microjoules
-    long long r_bytes; // read disk bytes
-    long long w_bytes; // written disk bytes
-};
-
-
 static int max_cpus = 0;
 static int *cgroup_perf_fds;
+static int *cgroup_llc_fds; // LLC misses per cpu, memory traffic for the DRAM share
 static char cgroup_path_id[220];
 static char cgroup_path_id_cpu[256];
 static char cgroup_path_id_mem[256];
@@ -32,6 +25,7 @@ pid_t cgroup_id;
 int init_benchmarking() {
     max_cpus = sysconf(_SC_NPROCESSORS_CONF);
     cgroup_perf_fds = malloc(sizeof(int) * max_cpus);
+    cgroup_llc_fds = malloc(sizeof(int) * max_cpus);
     // Add pid to cgroup path in case multiple instances are running at same time
     cgroup_id = getpid();
     // Create the cgroup_path_id strings
@@ -50,6 +44,7 @@ int reset_cgroup() {
     for (int i = 0; i < max_cpus; i++)
     {
         cgroup_perf_fds[i] = setUpProcCycles_cgroup(fd, i);
+        cgroup_llc_fds[i] = setUpProcLLCMisses_cgroup(fd, i);
     }
     close(fd);
 
@@ -60,6 +55,7 @@ int close_cgroup() {
     for (int i = 0; i < max_cpus; i++)
     {
         close(cgroup_perf_fds[i]);
+        close(cgroup_llc_fds[i]);
     }
     int status = rmdir(cgroup_path_id);
     return 0;
@@ -72,15 +68,23 @@ int read_cgroup_stats(struct cgroup_stats *cg_stats) {
     cg_stats->io_op = 0;
     cg_stats->cycles = 0;
     cg_stats->estimated_energy = 0;
+    cg_stats->estimated_dram_energy = 0;
 
-    // Cgroup Cycles
+    // Cgroup Cycles and LLC misses
     long long cpu_cycles = 0;
+    long long llc_misses = 0;
+    memset(cg_stats->cycles_package, 0, sizeof(cg_stats->cycles_package));
     for (int i = 0; i < max_cpus; i++)
     {
-        cpu_cycles += readInterval(cgroup_perf_fds[i]);
-        close(cgroup_perf_fds[i]);
+        long long cycles = readInterval(cgroup_perf_fds[i]);
+        cg_stats->cycles_package[cpu_to_package(i)] += cycles;
+        cpu_cycles += cycles;
+        closeEvent(cgroup_perf_fds[i]);
+        llc_misses += readInterval(cgroup_llc_fds[i]);
+        closeEvent(cgroup_llc_fds[i]);
     }
     cg_stats->cycles = cpu_cycles;
+    cg_stats->llc_misses = cgroup_llc_fds[0] == -1 ? -1 : llc_misses;
 
     // CPU time
     fp = fopen(cgroup_path_id_cpu, "r");
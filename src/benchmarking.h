@@ -1,6 +1,8 @@
 #ifndef benchmarking_h
 #define benchmarking_h
 
+#include "energy.h"
+
 extern pid_t cgroup_id;
 
 struct cgroup_stats { 
@@ -8,7 +10,10 @@ struct cgroup_stats {
     long long maxRSS; // in bytes
     unsigned long io_op;
     unsigned long long cycles;
-    long long estimated_energy; // in microjoules
+    long long cycles_package[RAPL_MAX_PACKAGES]; // cycles split by socket
+    long long llc_misses; // -1 if not counted
+    long long estimated_energy; // package share, in microjoules
+    long long estimated_dram_energy; // DRAM share, in microjoules
     long long r_bytes; // read disk bytes
     long long w_bytes; // written disk bytes
 };
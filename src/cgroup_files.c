@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include "cgroup_files.h"
+
+/* ///////////////////////////////////////////
+   Statistics of a cgroup v2 directory, one pass over each file:
+   cpu.stat for usage, user/system time and throttling, io.stat summed
+   over every device line, memory.current and the anon/file/kernel
+   split of memory.stat, and the "some"/"full" stall totals of the PSI
+   files. The files stay open and are re-read from offset 0 with pread.
+   A read fails with ENODEV once the cgroup is removed.
+*/ ///////////////////////////////////////////
+
+#define CGROUP_BUFFER 8192 // memory.stat is the largest, about 1.5 kB
+
+static const char *cgroup_file_names[CGROUP_FILES] = {"cpu.stat", "io.stat", "memory.current", "memory.stat",
+    "cpu.pressure", "io.pressure", "memory.pressure"};
+
+static char cgroup_buffer[CGROUP_BUFFER];
+
+// Whole file into cgroup_buffer, returns its length or -1
+static int read_cgroup_file(int fd) {
+    int length = 0;
+    ssize_t ret;
+    while (length < CGROUP_BUFFER - 1
+            && (ret = pread(fd, cgroup_buffer + length, CGROUP_BUFFER - 1 - length, length)) > 0) {
+        length += ret;
+    }
+    if (length == 0) {
+        return -1;
+    }
+    cgroup_buffer[length] = '\0';
+    return length;
+}
+
+// Digits right at p, p ends behind them
+static unsigned long long parse_number(const char **p) {
+    const char *c = *p;
+    unsigned long long value = 0;
+    while (*c >= '0' && *c <= '9') {
+        value = value * 10 + (*c++ - '0');
+    }
+    *p = c;
+    return value;
+}
+
+// Compares the word at p with key, p ends behind the word and its separator if it matches
+static int match_key(const char **p, const char *key, char separator) {
+    size_t length = strlen(key);
+    if (strncmp(*p, key, length) != 0 || (*p)[length] != separator) {
+        return 0;
+    }
+    *p += length + 1;
+    return 1;
+}
+
+static const char *next_line(const char *p) {
+    while (*p != '\n' && *p != '\0') {
+        p++;
+    }
+    return *p == '\n' ? p + 1 : p;
+}
+
+// "key value" lines of cpu.stat
+static void parse_cpu_stat(const char *p, struct cgroup_counters *counters) {
+    for (; *p != '\0'; p = next_line(p)) {
+        if (match_key(&p, "usage_usec", ' ')) {
+            counters->usage_usec = parse_number(&p);
+        } else if (match_key(&p, "user_usec", ' ')) {
+            counters->user_usec = parse_number(&p);
+        } else if (match_key(&p, "system_usec", ' ')) {
+            counters->system_usec = parse_number(&p);
+        } else if (match_key(&p, "nr_throttled", ' ')) {
+            counters->nr_throttled = parse_number(&p);
+        } else if (match_key(&p, "throttled_usec", ' ')) {
+            counters->throttled_usec = parse_number(&p);
+        }
+    }
+}
+
+// "maj:min rbytes=.. wbytes=.. rios=.. wios=.. dbytes=.. dios=.." per device
+static void parse_io_stat(const char *p, struct cgroup_counters *counters) {
+    counters->rbytes = counters->wbytes = counters->rios = counters->wios = 0;
+    for (; *p != '\0'; p++) {
+        if (*p != ' ') {
+            continue;
+        }
+        p++;
+        if (match_key(&p, "rbytes", '=')) {
+            counters->rbytes += parse_number(&p);
+        } else if (match_key(&p, "wbytes", '=')) {
+            counters->wbytes += parse_number(&p);
+        } else if (match_key(&p, "rios", '=')) {
+            counters->rios += parse_number(&p);
+        } else if (match_key(&p, "wios", '=')) {
+            counters->wios += parse_number(&p);
+        }
+        p--; // at the separator for the next field
+    }
+}
+
+// anon, file and kernel, older kernels have no "kernel" line and only its parts
+static void parse_memory_stat(const char *p, struct cgroup_counters *counters) {
+    long long kernel = -1, kernel_parts = 0;
+    counters->anon = counters->file = 0;
+    for (; *p != '\0'; p = next_line(p)) {
+        if (match_key(&p, "anon", ' ')) {
+            counters->anon = parse_number(&p);
+        } else if (match_key(&p, "file", ' ')) {
+            counters->file = parse_number(&p);
+        } else if (match_key(&p, "kernel", ' ')) {
+            kernel = parse_number(&p);
+        } else if (match_key(&p, "kernel_stack", ' ') || match_key(&p, "pagetables", ' ')
+                || match_key(&p, "percpu", ' ') || match_key(&p, "sock", ' ') || match_key(&p, "slab", ' ')) {
+            kernel_parts += parse_number(&p);
+        }
+    }
+    counters->kernel = kernel >= 0 ? kernel : kernel_parts;
+}
+
+// "some avg10=.. avg60=.. avg300=.. total=.." and the same for "full"
+static void parse_pressure(const char *p, unsigned long long *some, unsigned long long *full) {
+    for (; *p != '\0'; p = next_line(p)) {
+        unsigned long long *total = match_key(&p, "some", ' ') ? some : match_key(&p, "full", ' ') ? full : NULL;
+        const char *value = total != NULL ? strstr(p, "total=") : NULL;
+        if (value != NULL) {
+            value += 6;
+            *total = parse_number(&value);
+        }
+    }
+}
+
+// Opens the files of the cgroup directory, -1 if it has no cpu.stat (gone or not a cgroup)
+int open_cgroup_files(struct cgroup_files *files, const char *path) {
+    char file_path[1280];
+    for (int i = 0; i < CGROUP_FILES; i++) {
+        snprintf(file_path, sizeof(file_path), "%s/%s", path, cgroup_file_names[i]);
+        files->fds[i] = open(file_path, O_RDONLY | O_CLOEXEC);
+    }
+    if (files->fds[CGROUP_CPU_STAT] == -1) {
+        close_cgroup_files(files);
+        return -1;
+    }
+    return 0;
+}
+
+// Values of files that are missing stay as they were, -1 once the cgroup is removed
+int read_cgroup_files(struct cgroup_files *files, struct cgroup_counters *counters) {
+    if (files->fds[CGROUP_CPU_STAT] == -1 || read_cgroup_file(files->fds[CGROUP_CPU_STAT]) == -1) {
+        return -1;
+    }
+    parse_cpu_stat(cgroup_buffer, counters);
+    if (files->fds[CGROUP_IO_STAT] != -1) {
+        // empty without I/O
+        cgroup_buffer[0] = '\0';
+        read_cgroup_file(files->fds[CGROUP_IO_STAT]);
+        parse_io_stat(cgroup_buffer, counters);
+    }
+    if (files->fds[CGROUP_MEMORY_CURRENT] != -1 && read_cgroup_file(files->fds[CGROUP_MEMORY_CURRENT]) != -1) {
+        const char *p = cgroup_buffer;
+        counters->memory = parse_number(&p);
+    }
+    if (files->fds[CGROUP_MEMORY_STAT] != -1 && read_cgroup_file(files->fds[CGROUP_MEMORY_STAT]) != -1) {
+        parse_memory_stat(cgroup_buffer, counters);
+    }
+    if (files->fds[CGROUP_CPU_PRESSURE] != -1 && read_cgroup_file(files->fds[CGROUP_CPU_PRESSURE]) != -1) {
+        parse_pressure(cgroup_buffer, &counters->cpu_some, &counters->cpu_full);
+    }
+    if (files->fds[CGROUP_IO_PRESSURE] != -1 && read_cgroup_file(files->fds[CGROUP_IO_PRESSURE]) != -1) {
+        parse_pressure(cgroup_buffer, &counters->io_some, &counters->io_full);
+    }
+    if (files->fds[CGROUP_MEMORY_PRESSURE] != -1 && read_cgroup_file(files->fds[CGROUP_MEMORY_PRESSURE]) != -1) {
+        parse_pressure(cgroup_buffer, &counters->memory_some, &counters->memory_full);
+    }
+    return 0;
+}
+
+// Differences of the cumulative values, memory is a gauge and copied
+void cgroup_counters_interval(struct cgroup_counters *now, struct cgroup_counters *last,
+        struct cgroup_counters *interval) {
+    interval->usage_usec = now->usage_usec - last->usage_usec;
+    interval->user_usec = now->user_usec - last->user_usec;
+    interval->system_usec = now->system_usec - last->system_usec;
+    interval->nr_throttled = now->nr_throttled - last->nr_throttled;
+    interval->throttled_usec = now->throttled_usec - last->throttled_usec;
+    interval->rbytes = now->rbytes - last->rbytes;
+    interval->wbytes = now->wbytes - last->wbytes;
+    interval->rios = now->rios - last->rios;
+    interval->wios = now->wios - last->wios;
+    interval->memory = now->memory;
+    interval->anon = now->anon;
+    interval->file = now->file;
+    interval->kernel = now->kernel;
+    interval->cpu_some = now->cpu_some - last->cpu_some;
+    interval->cpu_full = now->cpu_full - last->cpu_full;
+    interval->io_some = now->io_some - last->io_some;
+    interval->io_full = now->io_full - last->io_full;
+    interval->memory_some = now->memory_some - last->memory_some;
+    interval->memory_full = now->memory_full - last->memory_full;
+}
+
+void close_cgroup_files(struct cgroup_files *files) {
+    for (int i = 0; i < CGROUP_FILES; i++) {
+        if (files->fds[i] != -1) {
+            close(files->fds[i]);
+            files->fds[i] = -1;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef cgroup_files_h
+#define cgroup_files_h
+
+// Files of a cgroup v2 directory, held open and re-read with pread
+#define CGROUP_CPU_STAT 0
+#define CGROUP_IO_STAT 1
+#define CGROUP_MEMORY_CURRENT 2
+#define CGROUP_MEMORY_STAT 3
+#define CGROUP_CPU_PRESSURE 4
+#define CGROUP_IO_PRESSURE 5
+#define CGROUP_MEMORY_PRESSURE 6
+#define CGROUP_FILES 7
+
+struct cgroup_files
+{
+    int fds[CGROUP_FILES]; // -1 where the file does not exist, e.g. no PSI or at the root
+};
+
+// Cumulative values, or the interval differences of them from cgroup_counters_interval
+struct cgroup_counters
+{
+    unsigned long long usage_usec; // cpu.stat
+    unsigned long long user_usec;
+    unsigned long long system_usec;
+    unsigned long long nr_throttled; // periods the cfs quota ran out
+    unsigned long long throttled_usec;
+    unsigned long long rbytes; // io.stat, all devices
+    unsigned long long wbytes;
+    unsigned long long rios;
+    unsigned long long wios;
+    long long memory; // memory.current in bytes, as read in intervals too
+    long long anon; // memory.stat in bytes, as read in intervals too
+    long long file;
+    long long kernel;
+    unsigned long long cpu_some; // PSI stall totals in microseconds
+    unsigned long long cpu_full;
+    unsigned long long io_some;
+    unsigned long long io_full;
+    unsigned long long memory_some;
+    unsigned long long memory_full;
+};
+
+int open_cgroup_files(struct cgroup_files *files, const char *path);
+
+int read_cgroup_files(struct cgroup_files *files, struct cgroup_counters *counters);
+
+void cgroup_counters_interval(struct cgroup_counters *now, struct cgroup_counters *last,
+        struct cgroup_counters *interval);
+
+void close_cgroup_files(struct cgroup_files *files);
+
+#endif
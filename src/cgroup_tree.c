@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "perf_events.h"
+#include "energy.h"
+#include "cgroup_tree.h"
+
+/* ///////////////////////////////////////////
+   Any cgroup v2 subtree, e.g. kubepods.slice or a podman/systemd
+   slice, walked down to a chosen depth on every update. cpu.stat,
+   io.stat and memory.current of a cgroup include its descendants, so
+   a node's own share is its value minus its children's. The files
+   stay open (cgroup_files.c) and move along with their node. Perf counters
+   only run at the leaves (depth reached or no child cgroups), a cgroup
+   event counts the whole subtree below it, and inner nodes get cycles
+   by the cpu time they have on their own. Nodes are kept in pre-order:
+   walking the array backwards visits children before their parents,
+   which rolls the energy up.
+*/ ///////////////////////////////////////////
+
+static int max_cpus = 0;
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp((*(struct cgroup_node * const *) a)->path, (*(struct cgroup_node * const *) b)->path);
+}
+
+// Index of a new node, the arrays of both walks grow together
+static int add_node(struct cgroup_tree *tree, const char *path, int parent, int depth) {
+    if (tree->num_nodes == tree->size) {
+        int size = tree->size == 0 ? 64 : tree->size * 2;
+        struct cgroup_node *nodes = realloc(tree->nodes, sizeof(struct cgroup_node) * size);
+        if (nodes == NULL) {
+            printf("Cgroup tree allocation failed.\n");
+            return -1;
+        }
+        tree->nodes = nodes;
+        struct cgroup_node *previous = realloc(tree->previous, sizeof(struct cgroup_node) * size);
+        if (previous == NULL) {
+            printf("Cgroup tree allocation failed.\n");
+            return -1;
+        }
+        tree->previous = previous;
+        struct cgroup_node **sorted = realloc(tree->sorted, sizeof(struct cgroup_node *) * size);
+        if (sorted == NULL) {
+            printf("Cgroup tree allocation failed.\n");
+            return -1;
+        }
+        tree->sorted = sorted;
+        tree->size = size;
+    }
+    struct cgroup_node *node = &tree->nodes[tree->num_nodes];
+    memset(node, 0, sizeof(struct cgroup_node));
+    snprintf(node->path, sizeof(node->path), "%s", path);
+    node->parent = parent;
+    node->depth = depth;
+    node->leaf = 1;
+    node->llc_misses_interval = -1;
+    return tree->num_nodes++;
+}
+
+// Pre-order walk, a node stops being a leaf once a child is found
+static void walk_cgroup(struct cgroup_tree *tree, const char *path, int parent, int depth) {
+    char dir_path[2 * CGROUP_PATH];
+    char child[CGROUP_PATH];
+    int index = add_node(tree, path, parent, depth);
+    if (index == -1 || depth == tree->max_depth) {
+        return;
+    }
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", tree->root, path);
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return; // removed meanwhile
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.') {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), path[0] == '\0' ? "%s%s" : "%s/%s", path,
+                entry->d_name) >= (int) sizeof(child)) {
+            continue;
+        }
+        tree->nodes[index].leaf = 0;
+        walk_cgroup(tree, child, index, depth + 1);
+    }
+    closedir(dir);
+}
+
+static void open_node_counters(struct cgroup_tree *tree, struct cgroup_node *node) {
+    char path[2 * CGROUP_PATH];
+    node->perf_fds = malloc(sizeof(int) * max_cpus);
+    node->llc_fds = malloc(sizeof(int) * max_cpus);
+    if (node->perf_fds == NULL || node->llc_fds == NULL) {
+        printf("Cgroup perf event array allocation failed.\n");
+        free(node->perf_fds);
+        free(node->llc_fds);
+        node->perf_fds = NULL;
+        node->llc_fds = NULL;
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", tree->root, node->path);
+    int fd = open(path, O_RDONLY);
+    for (int j = 0; j < max_cpus; j++) {
+        node->perf_fds[j] = setUpProcCycles_cgroup(fd, j);
+        node->llc_fds[j] = setUpProcLLCMisses_cgroup(fd, j);
+    }
+    close(fd);
+}
+
+static void close_node_counters(struct cgroup_node *node) {
+    for (int j = 0; j < max_cpus && node->perf_fds != NULL; j++) {
+        closeEvent(node->perf_fds[j]);
+        closeEvent(node->llc_fds[j]);
+    }
+    free(node->perf_fds);
+    free(node->llc_fds);
+    node->perf_fds = NULL;
+    node->llc_fds = NULL;
+}
+
+// Files that are missing (e.g. memory.current at the root) leave their values, a fresh node has no interval yet
+static void read_node_stats(struct cgroup_node *node) {
+    struct cgroup_counters last = node->counters;
+    if (read_cgroup_files(&node->files, &node->counters) == -1) {
+        node->counters = last; // removed meanwhile
+    }
+    cgroup_counters_interval(&node->counters, node->fresh ? &node->counters : &last, &node->counters_interval);
+    node->cputime_interval = node->counters_interval.usage_usec;
+    node->io_op_interval = node->counters_interval.rios + node->counters_interval.wios;
+}
+
+static void read_node_counters(struct cgroup_node *node) {
+    long long llc_misses = 0;
+    node->cycles_interval = 0;
+    memset(node->cycles_package, 0, sizeof(node->cycles_package));
+    for (int j = 0; j < max_cpus; j++) {
+        long long cycles = readInterval(node->perf_fds[j]);
+        node->cycles_package[cpu_to_package(j)] += cycles;
+        node->cycles_interval += cycles;
+        llc_misses += readInterval(node->llc_fds[j]);
+    }
+    node->llc_misses_interval = node->llc_fds[0] == -1 ? -1 : llc_misses;
+}
+
+struct cgroup_tree *init_cgroup_tree(const char *root, int max_depth) {
+    struct cgroup_tree *tree = calloc(1, sizeof(struct cgroup_tree));
+    if (tree == NULL) {
+        printf("Cgroup tree allocation failed.\n");
+        return NULL;
+    }
+    max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    // Every node holds its cgroup files open, leaves also two events per cpu
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    snprintf(tree->root, sizeof(tree->root), "%s", root);
+    tree->max_depth = max_depth;
+    // Start values of the first interval
+    if (update_cgroup_tree(tree) == -1) {
+        free_cgroup_tree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+// Walk the subtree again, nodes keep their values and counters by path, returns the number of nodes
+int update_cgroup_tree(struct cgroup_tree *tree) {
+    char path[2 * CGROUP_PATH];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", tree->root);
+    if (access(path, F_OK) == -1) {
+        perror("Couldn't open cgroup");
+        return -1;
+    }
+
+    // Last walk becomes the previous one
+    struct cgroup_node *swap = tree->previous;
+    tree->previous = tree->nodes;
+    tree->num_previous = tree->num_nodes;
+    tree->nodes = swap;
+    tree->num_nodes = 0;
+    walk_cgroup(tree, "", -1, 0);
+    // Sorted after the walk, it may move the arrays
+    for (int i = 0; i < tree->num_previous; i++) {
+        tree->sorted[i] = &tree->previous[i];
+    }
+    qsort(tree->sorted, tree->num_previous, sizeof(struct cgroup_node *), compare_path);
+
+    for (int i = 0; i < tree->num_nodes; i++) {
+        struct cgroup_node *node = &tree->nodes[i];
+        struct cgroup_node **last = bsearch(&node, tree->sorted, tree->num_previous,
+                sizeof(struct cgroup_node *), compare_path);
+        node->fresh = last == NULL;
+        if (last != NULL) {
+            node->files = (*last)->files;
+            node->counters = (*last)->counters;
+            memset(&(*last)->files, -1, sizeof((*last)->files)); // moved
+            node->perf_fds = (*last)->perf_fds;
+            node->llc_fds = (*last)->llc_fds;
+            (*last)->perf_fds = NULL; // moved
+            (*last)->llc_fds = NULL;
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", tree->root, node->path);
+            open_cgroup_files(&node->files, path);
+        }
+        // Counters only at the leaves, a node that got children hands them down
+        if (node->leaf && node->perf_fds == NULL) {
+            open_node_counters(tree, node);
+        } else if (!node->leaf && node->perf_fds != NULL) {
+            close_node_counters(node);
+        }
+    }
+    // Removed cgroups
+    for (int i = 0; i < tree->num_previous; i++) {
+        close_cgroup_files(&tree->previous[i].files);
+        if (tree->previous[i].perf_fds != NULL) {
+            close_node_counters(&tree->previous[i]);
+        }
+    }
+
+    for (int i = 0; i < tree->num_nodes; i++) {
+        struct cgroup_node *node = &tree->nodes[i];
+        read_node_stats(node);
+        if (node->perf_fds != NULL) {
+            read_node_counters(node);
+        }
+        node->own_cputime_interval = node->cputime_interval;
+        node->own_io_op_interval = node->io_op_interval;
+        node->own_memory = node->counters.memory;
+    }
+    // Own shares, children come after their parent
+    for (int i = 1; i < tree->num_nodes; i++) {
+        struct cgroup_node *parent = &tree->nodes[tree->nodes[i].parent];
+        parent->own_cputime_interval -= tree->nodes[i].cputime_interval;
+        parent->own_io_op_interval -= tree->nodes[i].io_op_interval;
+        parent->own_memory -= tree->nodes[i].counters.memory;
+    }
+    for (int i = 0; i < tree->num_nodes; i++) {
+        struct cgroup_node *node = &tree->nodes[i];
+        // Files are read one after the other, a child can be ahead of its parent
+        if (node->own_cputime_interval < 0) {
+            node->own_cputime_interval = 0;
+        }
+        if (node->own_io_op_interval < 0) {
+            node->own_io_op_interval = 0;
+        }
+        if (node->own_memory < 0) {
+            node->own_memory = 0;
+        }
+    }
+    return tree->num_nodes;
+}
+
+// Inner nodes without counters get the system cycles times their share of the cpu time (us)
+void estimate_residual_cycles(struct cgroup_tree *tree, long long *cycles_package, unsigned long long cputime) {
+    for (int i = 0; i < tree->num_nodes; i++) {
+        struct cgroup_node *node = &tree->nodes[i];
+        if (node->perf_fds != NULL) {
+            continue;
+        }
+        double share = cputime > 0 ? (double) node->own_cputime_interval / cputime : 0;
+        share = share > 1 ? 1 : share;
+        node->cycles_interval = 0;
+        for (int j = 0; j < num_packages; j++) {
+            node->cycles_package[j] = share * cycles_package[j];
+            node->cycles_interval += node->cycles_package[j];
+        }
+        node->llc_misses_interval = -1;
+    }
+}
+
+// A node's subtree energy is its own package and DRAM estimate plus its children's subtree energy
+void roll_up_cgroup_energy(struct cgroup_tree *tree) {
+    for (int i = 0; i < tree->num_nodes; i++) {
+        tree->nodes[i].energy_subtree_est = tree->nodes[i].energy_interval_est
+            + tree->nodes[i].energy_dram_interval_est;
+    }
+    for (int i = tree->num_nodes - 1; i > 0; i--) {
+        tree->nodes[tree->nodes[i].parent].energy_subtree_est += tree->nodes[i].energy_subtree_est;
+    }
+}
+
+void free_cgroup_tree(struct cgroup_tree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    for (int i = 0; i < tree->num_nodes; i++) {
+        close_cgroup_files(&tree->nodes[i].files);
+        close_node_counters(&tree->nodes[i]);
+    }
+    free(tree->nodes);
+    free(tree->previous);
+    free(tree->sorted);
+    free(tree);
+}
@@ -0,0 +1,57 @@
+#ifndef cgroup_tree_h
+#define cgroup_tree_h
+
+#include "energy.h"
+#include "cgroup_files.h"
+
+#define CGROUP_PATH 512 // relative to the monitored root
+
+// One cgroup of the monitored subtree, the cgroup files count everything below a node
+struct cgroup_node
+{
+    char path[CGROUP_PATH]; // "" for the root
+    int parent; // index, -1 for the root
+    int depth;
+    int leaf; // perf counters open, they count everything below it too
+    int fresh; // added by the last update, intervals start with the next one
+    unsigned long cputime_interval; // in microseconds, usage of the whole subtree
+    long io_op_interval;
+    long own_cputime_interval; // without the children, the whole subtree at leaves
+    long long own_memory; // in bytes of memory.current
+    long own_io_op_interval;
+    long long cycles_interval; // counted at leaves, from the cpu time share at inner nodes
+    long long cycles_package[RAPL_MAX_PACKAGES]; // cycles_interval split by socket
+    long long llc_misses_interval; // -1 if not counted
+    long long energy_interval_est; // own package share, in microjoules
+    long long energy_dram_interval_est; // own DRAM share, in microjoules
+    long long energy_subtree_est; // own package and DRAM plus all children's, in microjoules
+    struct cgroup_files files; // held open between walks
+    struct cgroup_counters counters; // as last read
+    struct cgroup_counters counters_interval; // since the update before, zero while fresh
+    int *perf_fds; // cycles per cpu, NULL unless leaf
+    int *llc_fds; // LLC misses per cpu, NULL unless leaf
+};
+
+struct cgroup_tree
+{
+    char root[CGROUP_PATH];
+    int max_depth; // nodes at this depth are leaves
+    struct cgroup_node *nodes; // pre-order, parents before their children
+    struct cgroup_node *previous; // nodes of the last walk
+    struct cgroup_node **sorted; // previous, by path
+    int num_nodes;
+    int num_previous;
+    int size;
+};
+
+struct cgroup_tree *init_cgroup_tree(const char *root, int max_depth);
+
+int update_cgroup_tree(struct cgroup_tree *tree);
+
+void estimate_residual_cycles(struct cgroup_tree *tree, long long *cycles_package, unsigned long long cputime);
+
+void roll_up_cgroup_energy(struct cgroup_tree *tree);
+
+void free_cgroup_tree(struct cgroup_tree *tree);
+
+#endif
@@ -1,290 +1,502 @@
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <string.h>
 #include "perf_events.h"
+#include "perf_sampling.h"
 #include "energy.h"
+#include "cgroup_files.h"
+#include "container_stats.h"
 
 /* ///////////////////////////////////////////
    using cgroups v2 /sys/fs/cgroup/system.slice contains
    the docker container cgroups, named docker-*ID*.scope,
-   /cpu.stat, /io.stat, /memory.stat or /memory.current have statistics
+   /cpu.stat, /io.stat, /memory.stat, /memory.current and the PSI
+   pressure files have statistics, read by cgroup_files.c
    /cgroup.procs + /cgroup.threads lists pids of the processes
+   new and removed containers come from inotify events on system.slice
+   perf events of new containers are opened by a pool of worker threads,
+   a burst of containers costs the update no perf_event_open calls
 */ ///////////////////////////////////////////
 
-// - use hashmap to store containers for efficiency
+// Containers live in a dense array that grows as needed, removal moves the last container into
+// the gap. An open addressing table maps the hash of the container id to index + 1. Each container
+// owns its per-cpu perf events, so they move along with it.
 
-#define MAX_CONTAINERS 25
-
-struct container_stats { 
-    char id[256];
-    unsigned long long cputime; // in microseconds
-    long long memory; // in bytes
-    unsigned long io_op;
-    // TODO process ids
-    unsigned long cputime_interval; // in microseconds
-    long long memory_interval; // in bytes
-    long io_op_interval;
-    unsigned long long cycles_interval;
-    long long energy_interval_est; // in microjoules
-};
-
-struct container_stats containers[MAX_CONTAINERS]; // Array to store container information
-static int *cgroup_perf_fds;
+struct container_stats *containers = NULL; // Array to store container information
+static int containers_size = 0;
+static int *container_slots = NULL;
+static int container_slots_size = 0; // power of two
+static int *sampling_fds; // per cpu, NULL unless cycles are sampled by cgroup id
+static const char *slice_path = "/sys/fs/cgroup/system.slice";
+static int inotify_fd = -1; // creations and removals in system.slice, -1 if it is read every update
+static int updates_since_scan = 0;
+// Setup queue, the workers only open events, tracking them for readInterval is left to the update
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t setup_queued = PTHREAD_COND_INITIALIZER;
+static struct perf_setup *setup_head = NULL, *setup_tail = NULL;
+static int num_setup_workers = -1; // started with the first setup, 0 if none could be
 int num_containers = 0; // Number of containers currently stored
 int max_cpus = 0;
 
 static int add_docker_container(char *id);
 static int remove_docker_container(int i);
 
+// FNV-1a of the container id
+static unsigned int hash_id(const char *id) {
+    unsigned int hash = 2166136261u;
+    for (; *id != '\0'; id++) {
+        hash = (hash ^ (unsigned char) *id) * 16777619u;
+    }
+    return hash;
+}
+
+static int grow_container_slots() {
+    int size = container_slots_size == 0 ? 64 : container_slots_size * 2;
+    int *resized = calloc(size, sizeof(int));
+    if (resized == NULL) {
+        printf("Container table allocation failed.\n");
+        return -1;
+    }
+    for (int i = 0; i < num_containers; i++) {
+        unsigned int slot = hash_id(containers[i].id) & (size - 1);
+        while (resized[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        resized[slot] = i + 1;
+    }
+    free(container_slots);
+    container_slots = resized;
+    container_slots_size = size;
+    return 0;
+}
+
+// Slot of the id, or of the empty slot it would go into
+static unsigned int find_container_slot(const char *id) {
+    unsigned int slot = hash_id(id) & (container_slots_size - 1);
+    while (container_slots[slot] != 0 && strcmp(containers[container_slots[slot] - 1].id, id) != 0) {
+        slot = (slot + 1) & (container_slots_size - 1);
+    }
+    return slot;
+}
+
+// Empty a slot, later entries of the probe sequence move up so no lookup stops early
+static void delete_container_slot(unsigned int slot) {
+    unsigned int mask = container_slots_size - 1;
+    unsigned int hole = slot;
+    for (unsigned int next = (slot + 1) & mask; container_slots[next] != 0; next = (next + 1) & mask) {
+        unsigned int home = hash_id(containers[container_slots[next] - 1].id) & mask;
+        // movable if the hole lies between its home slot and where it is now
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            container_slots[hole] = container_slots[next];
+            hole = next;
+        }
+    }
+    container_slots[hole] = 0;
+}
+
+// Container id of a "docker-<id>.scope" cgroup directory, -1 for other entries
+static int container_id(const char *name, char *id, size_t size) {
+    size_t length = strlen(name);
+    if (strncmp(name, "docker-", 7) != 0 || length < 13 || strcmp(name + length - 6, ".scope") != 0
+            || length - 13 >= size) {
+        return -1;
+    }
+    memcpy(id, name + 7, length - 13);
+    id[length - 13] = '\0';
+    return 0;
+}
+
+// Watch system.slice, the queued events are applied by update_docker_containers
+static int watch_docker_containers() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, slice_path, IN_CREATE | IN_DELETE | IN_ONLYDIR) == -1) {
+        perror("Couldn't watch cgroup directory, reading it every interval");
+        if (inotify_fd != -1) {
+            close(inotify_fd);
+        }
+        inotify_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Closes the events of a setup that was never taken over
+static void free_perf_setup(struct perf_setup *setup) {
+    for (int j = 0; j < max_cpus; j++) {
+        if (setup->perf_fds[j] != -1) {
+            close(setup->perf_fds[j]);
+        }
+        if (setup->llc_fds[j] != -1) {
+            close(setup->llc_fds[j]);
+        }
+    }
+    free(setup->perf_fds);
+    free(setup->llc_fds);
+    free(setup);
+}
+
+static void run_perf_setup(struct perf_setup *setup) {
+    for (int j = 0; j < max_cpus; j++) {
+        setup->perf_fds[j] = openCgroupCycles(setup->cgroup_fd, j);
+        setup->llc_fds[j] = openCgroupLLCMisses(setup->cgroup_fd, j);
+    }
+    close(setup->cgroup_fd);
+}
+
+static void *perf_setup_worker(void *arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&setup_lock);
+        while (setup_head == NULL) {
+            pthread_cond_wait(&setup_queued, &setup_lock);
+        }
+        struct perf_setup *setup = setup_head;
+        setup_head = setup->next;
+        if (setup_head == NULL) {
+            setup_tail = NULL;
+        }
+        int cancelled = setup->cancelled;
+        pthread_mutex_unlock(&setup_lock);
+
+        if (cancelled) {
+            close(setup->cgroup_fd);
+        } else {
+            run_perf_setup(setup);
+        }
+
+        pthread_mutex_lock(&setup_lock);
+        if (setup->cancelled) {
+            free_perf_setup(setup);
+        } else {
+            setup->done = 1;
+        }
+        pthread_mutex_unlock(&setup_lock);
+    }
+    return NULL;
+}
+
+static void start_perf_setup_workers() {
+    pthread_t thread_id;
+    num_setup_workers = 0;
+    for (int i = 0; i < PERF_SETUP_WORKERS; i++) {
+        if (pthread_create(&thread_id, NULL, perf_setup_worker, NULL) != 0) {
+            perror("Couldn't start perf setup worker");
+            break;
+        }
+        pthread_detach(thread_id);
+        num_setup_workers++;
+    }
+}
+
+// Queue the perf events of a container cgroup, opened in place if no worker runs
+static struct perf_setup *queue_perf_setup(const char *path) {
+    struct perf_setup *setup = calloc(1, sizeof(struct perf_setup));
+    if (setup == NULL) {
+        printf("Container perf setup allocation failed.\n");
+        return NULL;
+    }
+    setup->perf_fds = malloc(sizeof(int) * max_cpus);
+    setup->llc_fds = malloc(sizeof(int) * max_cpus);
+    setup->cgroup_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (setup->perf_fds == NULL || setup->llc_fds == NULL || setup->cgroup_fd == -1) {
+        printf("Container perf setup failed.\n");
+        if (setup->cgroup_fd != -1) {
+            close(setup->cgroup_fd);
+        }
+        free(setup->perf_fds);
+        free(setup->llc_fds);
+        free(setup);
+        return NULL;
+    }
+    for (int j = 0; j < max_cpus; j++) {
+        setup->perf_fds[j] = -1;
+        setup->llc_fds[j] = -1;
+    }
+
+    if (num_setup_workers == -1) {
+        start_perf_setup_workers();
+    }
+    if (num_setup_workers == 0) {
+        run_perf_setup(setup);
+        setup->done = 1;
+        return setup;
+    }
+    pthread_mutex_lock(&setup_lock);
+    if (setup_tail == NULL) {
+        setup_head = setup;
+    } else {
+        setup_tail->next = setup;
+    }
+    setup_tail = setup;
+    pthread_cond_signal(&setup_queued);
+    pthread_mutex_unlock(&setup_lock);
+    return setup;
+}
+
+// Take over the events of a finished setup, 0 while the worker is not done yet
+static int take_perf_setup(struct container_stats *container) {
+    pthread_mutex_lock(&setup_lock);
+    int done = container->setup->done;
+    pthread_mutex_unlock(&setup_lock);
+    if (!done) {
+        return 0;
+    }
+    struct perf_setup *setup = container->setup;
+    for (int j = 0; j < max_cpus; j++) {
+        setup->perf_fds[j] = trackCounter(setup->perf_fds[j], j);
+        setup->llc_fds[j] = trackCounter(setup->llc_fds[j], j);
+    }
+    container->perf_fds = setup->perf_fds;
+    container->llc_fds = setup->llc_fds;
+    container->setup = NULL;
+    free(setup);
+    return 1;
+}
+
+// A running setup is freed by its worker, a finished or a queued one right away
+static void cancel_perf_setup(struct perf_setup *setup) {
+    pthread_mutex_lock(&setup_lock);
+    if (setup->done) {
+        free_perf_setup(setup);
+    } else {
+        setup->cancelled = 1;
+    }
+    pthread_mutex_unlock(&setup_lock);
+}
+
 int init_docker_container() {
     max_cpus = sysconf(_SC_NPROCESSORS_CONF);
-    int size = max_cpus * MAX_CONTAINERS;
-    cgroup_perf_fds = malloc(sizeof(int) * size);
-    if (cgroup_perf_fds == NULL) {
-        printf("Container perf event array allocation failed.\n");
+    watch_docker_containers();
+    return grow_container_slots();
+}
+
+// One cycles sampling event per cpu replaces the max_cpus cgroup events per container
+int init_docker_container_sampling() {
+    if (init_docker_container() == -1) {
+        return -1;
+    }
+    int *fds = malloc(sizeof(int) * max_cpus);
+    if (fds == NULL) {
+        printf("Container sampling array allocation failed.\n");
         return -1;
     }
+    for (int j = 0; j < max_cpus; j++) {
+        fds[j] = setUpCpuSampling(j, 1);
+        if (fds[j] == -1) {
+            for (int k = 0; k < j; k++) {
+                closeSampling(fds[k]);
+            }
+            free(fds);
+            return -1;
+        }
+    }
+    sampling_fds = fds;
     return 0;
 }
 
-int get_docker_containers() {
-    // open cgroup directory
-    char *dir_path = "/sys/fs/cgroup/system.slice";
-    DIR *dir = opendir(dir_path);
+// cgroup v2 id as reported by PERF_SAMPLE_CGROUP, the kernfs file handle holds it
+static unsigned long long read_cgroup_id(const char *path) {
+    unsigned long long cgroup_id = 0;
+    int mount_id;
+    struct file_handle *handle = malloc(sizeof(struct file_handle) + sizeof(cgroup_id));
+    if (handle == NULL) {
+        return 0;
+    }
+    handle->handle_bytes = sizeof(cgroup_id);
+    if (name_to_handle_at(AT_FDCWD, path, handle, &mount_id, 0) == -1) {
+        perror("Couldn't resolve cgroup id");
+    } else {
+        memcpy(&cgroup_id, handle->f_handle, sizeof(cgroup_id));
+    }
+    free(handle);
+    return cgroup_id;
+}
+
+// Add the containers of system.slice that are not monitored yet
+static int scan_docker_containers() {
+    char id[256];
+    DIR *dir = opendir(slice_path);
     if (dir == NULL) {
         perror("No cgroup v2");
+        return -1;
     }
-    // walk through directory
+    // Sub directories with name "docker-X.scope" where x is container ID
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
-        // Sub directory with name "docker-X" where x is container ID
-        if (strncmp(entry->d_name, "docker-", 7) == 0) {
-            char *id_str = entry->d_name + 7;
-            size_t id_length = strlen(id_str);
-            id_str[id_length - 6] = '\0'; // removing ".scope"
-            add_docker_container(id_str);
+        if (container_id(entry->d_name, id, sizeof(id)) == 0 && container_slots[find_container_slot(id)] == 0) {
+            add_docker_container(id);
         }
     }
     closedir(dir);
-    
     return 0;
 }
 
+// Apply the queued creations and removals of container cgroups, -1 if the queue overflowed
+static int handle_container_events() {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char id[256];
+    int overflow = 0;
+    ssize_t length;
+
+    while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        struct inotify_event *event;
+        for (char *ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = 1;
+            }
+            if (event->len == 0 || container_id(event->name, id, sizeof(id)) == -1) {
+                continue;
+            }
+            int index = container_slots[find_container_slot(id)] - 1;
+            if ((event->mask & IN_CREATE) && index == -1) {
+                add_docker_container(id);
+            } else if ((event->mask & IN_DELETE) && index != -1) {
+                remove_docker_container(index);
+            }
+        }
+    }
+    return overflow ? -1 : 0;
+}
+
+int get_docker_containers() {
+    return scan_docker_containers();
+}
+
 int update_docker_containers() {
-    char path[512];
-    char line[256];
-    FILE *fp;
+    // Containers created or removed since the last update, events are lost on overflow
+    int rescan = inotify_fd == -1 || ++updates_since_scan >= CONTAINER_RESCAN;
+    if (inotify_fd != -1 && handle_container_events() == -1) {
+        rescan = 1;
+    }
+    // Samples since the last update, aggregated by cgroup id
+    if (sampling_fds != NULL) {
+        clearSamples();
+        for (int j = 0; j < max_cpus; j++) {
+            readSamples(sampling_fds[j]);
+        }
+    }
     // Update current containers
     for (int i = 0; i < num_containers; i++)
     {
-        // Update and remove terminated containers
-        // Cpu stats
-        snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/cpu.stat",
-                                    containers[i].id);
-        fp = fopen(path, "r");
-        if (fp == NULL) {
-            perror("Couldn't open /cpu.stat file\n");
+        // Update and remove terminated containers, reads fail once the cgroup is gone
+        struct cgroup_counters last = containers[i].counters;
+        if (read_cgroup_files(&containers[i].files, &containers[i].counters) == -1) {
+            perror("Couldn't read container cgroup files");
             // Remove container, adjust loop
             remove_docker_container(i);
             i--;
             continue;
         }
-        // Read the cpu.stat file
-        unsigned long long usage_usec;
-        fscanf(fp, "%*s %llu", &usage_usec);
-        containers[i].cputime_interval = usage_usec - containers[i].cputime;
-        containers[i].cputime = usage_usec;
-        //printf("Container CPU usage in microseconds (interval): %lu\n", containers[i].cputime_interval);
-        fclose(fp);
-
-        // IO stats
-        snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/io.stat",
-                                    containers[i].id);
-        fp = fopen(path, "r");
-        if (fp == NULL) {
-            perror("Couldn't open /io.stat file");
-            // Remove container, adjust loop
-            remove_docker_container(i);
-            i--;
-            continue;
-        }
-        // Read the io.stat file
-        unsigned long long rbytes = 0, wbytes = 0, rios = 0, wios = 0, ios = 0;
-        if (fgets(line, sizeof(line), fp)) {
-            sscanf(line,"%*d:%*d rbytes=%llu wbytes=%llu rios=%llu wios=%llu",&rbytes,&wbytes,&rios,&wios);
-        }
-        fclose(fp);
-        ios = rios + wios;
+        cgroup_counters_interval(&containers[i].counters, &last, &containers[i].counters_interval);
+        unsigned long long ios = containers[i].counters.rios + containers[i].counters.wios;
+        containers[i].cputime_interval = containers[i].counters_interval.usage_usec;
         containers[i].io_op_interval = ios - containers[i].io_op;
+        containers[i].memory_interval = containers[i].counters.memory - containers[i].memory;
+        containers[i].cputime = containers[i].counters.usage_usec;
         containers[i].io_op = ios;
-        //printf("Container IO operations in interval: %ld \n", containers[i].io_op_interval);
+        containers[i].memory = containers[i].counters.memory;
 
-        // Memory stats
-        snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/memory.current",
-                                    containers[i].id);
-        fp = fopen(path, "r");
-        if (fp == NULL) {
-            // Remove container, adjust loop
-            remove_docker_container(i);
-            i--;
+        // Read perf events, a container joins once its setup is done and covers a whole interval after that
+        if (containers[i].counters_state == CONTAINER_PARTIAL) {
+            containers[i].counters_state = CONTAINER_LIVE;
+        }
+        if (containers[i].setup != NULL) {
+            if (!take_perf_setup(&containers[i])) {
+                containers[i].cycles_interval = 0;
+                memset(containers[i].cycles_package, 0, sizeof(containers[i].cycles_package));
+                containers[i].llc_misses_interval = -1;
+                continue;
+            }
+            containers[i].counters_state = CONTAINER_PARTIAL;
+        }
+        if (sampling_fds != NULL) {
+            containers[i].cycles_interval = sampledCgroupCycles(containers[i].cgroup_id,
+                    containers[i].cycles_package);
+            containers[i].llc_misses_interval = -1;
             continue;
         }
-        // Read the memory.current file
-        long long cur_memory = 0;
-        fscanf(fp, "%lld", &cur_memory);
-        containers[i].memory_interval = containers[i].memory - cur_memory;
-        containers[i].memory = cur_memory;
-        //printf("Container Memory change: %llu\n", containers[i].memory_interval);
-        fclose(fp);
-
-        // Read perf events
         long long cgroup_cycles = 0;
-        int offset = max_cpus*i;
+        long long cgroup_llc_misses = 0;
+        memset(containers[i].cycles_package, 0, sizeof(containers[i].cycles_package));
         for (int j = 0; j < max_cpus; j++)
         {
-            cgroup_cycles += readInterval(cgroup_perf_fds[j+offset]);
+            long long cycles = readInterval(containers[i].perf_fds[j]);
+            containers[i].cycles_package[cpu_to_package(j)] += cycles;
+            cgroup_cycles += cycles;
+            cgroup_llc_misses += readInterval(containers[i].llc_fds[j]);
         }
         containers[i].cycles_interval = cgroup_cycles;
+        containers[i].llc_misses_interval = containers[i].llc_fds[0] == -1 ? -1 : cgroup_llc_misses;
         
     }
-    // Check directory to add new ones
-    char *dir_path = "/sys/fs/cgroup/system.slice";
-    DIR *dir = opendir(dir_path);
-    if (dir == NULL) {
-        perror("No cgroup v2");
-    }
-
-    // Walk through directory
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        int already_monitored = 0;
-        // Sub directory with name "docker-X" where x is container ID
-        if (strncmp(entry->d_name, "docker-", 7) == 0) {
-            char *id_str = entry->d_name + 7;
-            size_t id_length = strlen(id_str);
-            id_str[id_length - 6] = '\0'; // removing ".scope"
-
-            for (int j = 0; j < num_containers; j++) {
-                if (strcmp(containers[j].id, id_str) == 0) {
-                    // Container is already being monitored
-                    already_monitored = 1;
-                    break;
-                }
-            }
-            if (already_monitored == 1) {
-                continue;
-            }
-            // Add new container to monitor
-            add_docker_container(id_str);
-        }
+    // Check directory to add new ones, only as a safety net while inotify works
+    if (rescan) {
+        updates_since_scan = 0;
+        scan_docker_containers();
     }
-    closedir(dir);
+    return 0;
 }
 
 static int add_docker_container(char *id_str) {
-    if (num_containers == MAX_CONTAINERS) {
+    // keep the load below 70%
+    if (num_containers * 10 >= container_slots_size * 7 && grow_container_slots() == -1) {
         return -1;
     }
-    char line[256];
+    if (num_containers == containers_size) {
+        int size = containers_size == 0 ? 32 : containers_size * 2;
+        struct container_stats *resized = realloc(containers, sizeof(struct container_stats) * size);
+        if (resized == NULL) {
+            printf("Container array allocation failed.\n");
+            return -1;
+        }
+        containers = resized;
+        containers_size = size;
+    }
     struct container_stats container;
+    memset(&container, 0, sizeof(container));
     strcpy(container.id, id_str);
-    container.cputime = 0;
-    container.memory = 0;
-    container.io_op = 0;
-    container.cputime_interval = 0;
-    container.memory_interval = 0;
-    container.io_op_interval = 0;
-    container.energy_interval_est = 0;
+    container.llc_misses_interval = -1;
     // Container cgroup
     printf("Adding Container %s \n", id_str);
-    FILE *fp;
     char path[512];
-    /*// Check container process ids
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/cgroup.procs", id);
-    fp = fopen(path, "r");
-    if (fp == NULL) {
-        perror("Couldn't open /cgroups.procs file");
-        return -1;
-    }
-    printf("Includes processes: \n");
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        printf("%s", line);
-    }
-    fclose(fp);*/
-
-    // Get entire container stats
-    // Cpu stats
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/cpu.stat", id_str);
-    fp = fopen(path, "r");
-    if (fp == NULL) {
-        perror("Couldn't open /cpu.stat file, addcontainer");
-        return -1;
-    }
-    // Read the cpu.stats file
-    unsigned long long usage_usec;
-    fscanf(fp, "%*s %llu", &container.cputime);
-    fclose(fp);
-
-    // IO stats
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/io.stat", id_str);
-    fp = fopen(path, "r");
-    if (fp == NULL) {
-        perror("Couldn't open /io.stat file, addcontainer");
-        return -1;
-    }
-    // Read the io.stat file
-    unsigned long long rbytes = 0, wbytes = 0, rios = 0, wios = 0, ios = 0;
-    if (fgets(line, sizeof(line), fp)) {
-        if (sscanf(line, "%*d:%*d rbytes=%llu wbytes=%llu rios=%llu wios=%llu", &rbytes, &wbytes, &rios, &wios) == 4) {
-            /*printf("Container Read Bytes: %llu\n", rbytes);
-            printf("Container Write Bytes: %llu\n", wbytes);
-            printf("Container Read I/Os: %llu\n", rios);
-            printf("Container Write I/Os: %llu\n", wios);*/
-        }
-    }
-    fclose(fp);
-    ios = rios + wios;
-    container.io_op = ios;
 
-    // Memory stats
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/memory.current", id_str);
-    fp = fopen(path, "r");
-    if (fp == NULL) {
-        perror("Couldn't open /memory.current file, addcontainer");
+    // Get entire container stats, the files stay open for the updates
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope", id_str);
+    if (open_cgroup_files(&container.files, path) == -1
+            || read_cgroup_files(&container.files, &container.counters) == -1) {
+        perror("Couldn't open container cgroup files, addcontainer");
+        close_cgroup_files(&container.files);
         return -1;
     }
-    // Read the memory.current file
-    fscanf(fp, "%lld", &container.memory);
-    fclose(fp);
-    
-    /*
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s/memory.stat", id_str);
-    fp = fopen(path, "r");
-    if (fp == NULL) {
-        perror("Couldn't open /memory.current file");
-        return 1;
-    }
-    // possibly read memory.stats file? anon + file + kernel = mem.current
-
-    fclose(fp);
-    */
+    container.cputime = container.counters.usage_usec;
+    container.io_op = container.counters.rios + container.counters.wios;
+    container.memory = container.counters.memory;
 
     // Open perf events for cgroup
     snprintf(path, sizeof(path), "/sys/fs/cgroup/system.slice/docker-%s.scope/", id_str);
-    int fd = open(path, O_RDONLY);
-    int offset = num_containers*max_cpus;
-    for (int j = 0; j < max_cpus; j++)
-    {
-        cgroup_perf_fds[offset+j] = setUpProcCycles_cgroup(fd, j);
+    if (sampling_fds != NULL) { // cycles come from the per-cpu samples
+        container.cgroup_id = read_cgroup_id(path);
+        container.counters_state = CONTAINER_LIVE;
+    } else {
+        container.setup = queue_perf_setup(path);
+        if (container.setup == NULL) {
+            close_cgroup_files(&container.files);
+            return -1;
+        }
+        container.counters_state = CONTAINER_PENDING;
     }
-    close(fd);
 
+    container_slots[find_container_slot(id_str)] = num_containers + 1;
     containers[num_containers] = container;
     num_containers++;
 
@@ -293,16 +505,26 @@ static int add_docker_container(char *id_str) {
 
 static int remove_docker_container (int i) {
     // Close associated perf events
-    int offset = i*max_cpus;
-    for (int j = 0; j < max_cpus; j++)
+    if (containers[i].setup != NULL) {
+        cancel_perf_setup(containers[i].setup);
+    }
+    for (int j = 0; j < max_cpus && containers[i].perf_fds != NULL; j++)
     {
-        closeEvent(cgroup_perf_fds[offset+j]);
-        cgroup_perf_fds[offset+j] = cgroup_perf_fds[num_containers+j];
+        closeEvent(containers[i].perf_fds[j]);
+        closeEvent(containers[i].llc_fds[j]);
     }
+    free(containers[i].perf_fds);
+    free(containers[i].llc_fds);
+    close_cgroup_files(&containers[i].files);
     
-    // Remove container
+    // Remove container, the last one moves into its index
     printf("Removing container %s\n", containers[i].id);
-    containers[i] = containers[num_containers-1];
+    int last = num_containers - 1;
+    delete_container_slot(find_container_slot(containers[i].id));
+    if (i != last) {
+        container_slots[find_container_slot(containers[last].id)] = i + 1;
+        containers[i] = containers[last];
+    }
     num_containers--;
 
     return 0;
@@ -1,7 +1,27 @@
 #ifndef container_stats_h
 #define container_stats_h
 
-#define MAX_CONTAINERS 25
+#include "energy.h"
+#include "cgroup_files.h"
+
+#define CONTAINER_RESCAN 60 // updates between full rescans of system.slice while inotify works
+#define PERF_SETUP_WORKERS 4 // threads opening the perf events of new containers
+
+// Whether the cycles of a container cover the last interval
+#define CONTAINER_PENDING 0 // perf events still being opened, no cycles
+#define CONTAINER_PARTIAL 1 // perf events went live during the interval
+#define CONTAINER_LIVE 2
+
+// Perf events of a new container, opened by a worker thread
+struct perf_setup
+{
+    int cgroup_fd;
+    int *perf_fds; // -1 until opened
+    int *llc_fds;
+    int done; // events enabled, picked up by the next update
+    int cancelled; // container removed meanwhile, the worker frees the setup
+    struct perf_setup *next; // queue of the workers
+};
 
 struct container_stats { 
     char id[256];
@@ -13,15 +33,28 @@ struct container_stats {
     long long memory_interval; // in bytes
     long io_op_interval;
     unsigned long long cycles_interval;
-    long long energy_interval_est; // in microjoules
+    long long cycles_package[RAPL_MAX_PACKAGES]; // cycles_interval split by socket
+    long long llc_misses_interval; // -1 if not counted, e.g. with cycles sampling
+    long long energy_interval_est; // package share, in microjoules
+    long long energy_dram_interval_est; // DRAM share, in microjoules
+    unsigned long long cgroup_id; // cgroup v2 id, key of the sampled cycles
+    struct cgroup_files files; // held open between updates
+    struct cgroup_counters counters; // as last read
+    struct cgroup_counters counters_interval; // since the update before
+    int *perf_fds; // cycles per cpu, NULL with cycles sampling
+    int *llc_fds; // LLC misses per cpu, NULL with cycles sampling
+    int counters_state; // CONTAINER_PENDING, CONTAINER_PARTIAL or CONTAINER_LIVE
+    struct perf_setup *setup; // NULL once the perf events are taken over
 };
 
-extern struct container_stats containers[MAX_CONTAINERS];
+extern struct container_stats *containers; // num_containers entries, order changes on removal
 
 extern int num_containers;
 
 int init_docker_container();
 
+int init_docker_container_sampling();
+
 int get_docker_containers();
 
 int update_docker_containers();
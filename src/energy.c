@@ -3,57 +3,532 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include "energy.h"
+#include "perf_events.h"
 
-// TODO hardcoded energy paths
-#define RAPL_PKG_ENERGY_FILE "/sys/devices/virtual/powercap/intel-rapl/intel-rapl:0/energy_uj"
-#define RAPL_CORE_ENERGY_FILE "/sys/devices/virtual/powercap/intel-rapl/intel-rapl:0/intel-rapl:0:0/energy_uj"
-#define RAPL_UNCORE_ENERGY_FILE "/sys/devices/virtual/powercap/intel-rapl/intel-rapl:0/intel-rapl:0:1/energy_uj"
-#define RAPL_DRAM_ENERGY_FILE "/sys/devices/virtual/powercap/intel-rapl/intel-rapl:0/intel-rapl:0:2/energy_uj"
-#define RAPL_PSYS_ENERGY_FILE "/sys/devices/virtual/powercap/intel-rapl/intel-rapl:1/energy_uj"
-#define RAPL_MAX_RANGE "/sys/devices/virtual/powercap/intel-rapl/intel-rapl:0/max_energy_range_uj"
+#define POWERCAP_DIR "/devices/virtual/powercap"
+
+#define DEFAULT_MAX_POWER 500000000LL // in microwatts, if a zone has no power constraint
+#define MIN_TICK_MS 10
+#define MAX_TICK_MS 60000
+
+#define MSR_RAPL_POWER_UNIT 0x606
+#define MSR_PKG_ENERGY_STATUS 0x611
+#define MSR_DRAM_ENERGY_STATUS 0x619
+#define MSR_PP0_ENERGY_STATUS 0x639
 
-// potentially more packages 
 // pp0 + pp1 <= pkg, dram independent, pkg + dram <= psys includes all
 
-static long long max_range; // in microjoules
-static long long idle_consumption; // in microjoules
-static long long idle_min; // in microjoules
+struct rapl_domain rapl_domains[RAPL_MAX_DOMAINS]; // all zones found under powercap
+int num_rapl_domains = 0;
+// index into rapl_domains by type and package, -1 if not present
+static int domain_index[RAPL_NUM_TYPES][RAPL_MAX_PACKAGES];
+static char sysfs_root[128] = "/sys";
+static char msr_root[128] = "/dev/cpu"; // <msr_root>/<cpu>/msr
+static char cpuinfo_path[160] = "/proc/cpuinfo"; // follows msr_root, the model picks the dram unit
+int num_packages = 1;
+static int *cpu_package; // package id per cpu
+static int max_cpus = 0;
 
-// 0->pkg, 1->cores, 2->uncore, 3->dram, 4->psys, separate functions more energy efficient?
-long long read_energy(int domain) {
-    FILE *fp;
-    long long energy_microjoules;
+static long long max_range; // in microjoules, of the active energy source
+static long long idle_consumption; // in microjoules per second
+static long long idle_min; // in microjoules per second
+static long long idle_dram_consumption; // part of idle_consumption, 0 without per package calibration
+static long long idle_dram_min;
+// idle profile from config_idle.txt, per package only if calibrated with the new format
+static struct idle_stats idle_total;
+static struct idle_stats idle_pkg[RAPL_MAX_PACKAGES];
+static struct idle_stats idle_dram[RAPL_MAX_PACKAGES];
+static int idle_per_package = 0;
+
+// Change where /sys is looked up, e.g. a fake tree for testing. Call before init_rapl()
+void set_sysfs_root(const char *root) {
+    snprintf(sysfs_root, sizeof(sysfs_root), "%s", root);
+}
+
+// Change where the msr device files are looked up, e.g. regular files with fake registers,
+// the cpu model is then read from <root>/cpuinfo of the same tree
+void set_msr_root(const char *root) {
+    snprintf(msr_root, sizeof(msr_root), "%s", root);
+    snprintf(cpuinfo_path, sizeof(cpuinfo_path), "%s/cpuinfo", root);
+}
+
+// Digits only, sysfs values are plain unsigned decimals followed by a newline
+static long long parse_uj(const char *buf, ssize_t len) {
+    long long value = 0;
+    for (ssize_t i = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+        value = value * 10 + (buf[i] - '0');
+    }
+    return value;
+}
+
+static long long read_domain(struct rapl_domain *domain) {
+    char buf[32];
+    // sysfs regenerates the value on every read at offset 0
+    ssize_t len = pread(domain->fd, buf, sizeof(buf), 0);
+    if (len <= 0) {
+        return 0;
+    }
+    return parse_uj(buf, len);
+}
+
+/* ///////////////////////////////////////////
+   Energy sources, every read_energy*() goes through the active one:
+   powercap sysfs zones or the perf power PMU
+*/ ///////////////////////////////////////////
+
+// powercap: 0->pkg, 1->cores, 2->uncore, 3->dram, 4->psys of one package (psys only package 0)
+static long long read_powercap(int domain, int package) {
+    int index = domain_index[domain][package];
+    if (index == -1) {
+        return 0;
+    }
+    return read_domain(&rapl_domains[index]);
+}
+
+static void read_powercap_snapshot(struct energy_snapshot *snapshot) {
+    for (int i = 0; i < num_packages; i++) {
+        snapshot->pkg[i] = read_powercap(RAPL_PKG, i);
+        snapshot->dram[i] = read_powercap(RAPL_DRAM, i);
+    }
+}
+
+static int init_powercap_source() {
+    if (domain_index[RAPL_PKG][0] == -1) {
+        printf("No RAPL package domain found in powercap\n");
+        return -1;
+    }
+    return 0;
+}
+
+static long long powercap_range(int domain, int package) {
+    int index = domain_index[domain][package];
+    return index == -1 ? 0 : rapl_domains[index].max_range;
+}
+
+// Zones stay open, their max power is looked up whatever the active source
+static void close_powercap_source() {
+}
+
+// perf power PMU: one PERF_FORMAT_GROUP read of pkg and ram on each socket's lead cpu
+static int perf_energy_fds[RAPL_MAX_PACKAGES];
+static int perf_ram_fds[RAPL_MAX_PACKAGES]; // group members, -1 without ram
+
+static void read_perf_snapshot(struct energy_snapshot *snapshot) {
+    for (int i = 0; i < num_packages; i++) {
+        if (readEnergyGroup(perf_energy_fds[i], &snapshot->pkg[i], &snapshot->dram[i]) == -1) {
+            snapshot->pkg[i] = 0;
+            snapshot->dram[i] = 0;
+        }
+    }
+}
+
+// only pkg and ram are counted by the power PMU
+static long long read_perf(int domain, int package) {
+    long long pkg, ram;
+    if ((domain != RAPL_PKG && domain != RAPL_DRAM)
+            || readEnergyGroup(perf_energy_fds[package], &pkg, &ram) == -1) {
+        return 0;
+    }
+    return domain == RAPL_PKG ? pkg : ram;
+}
 
+static int init_perf_source() {
+    int supported = initEnergy();
+    if (supported == -1) {
+        return -1;
+    }
+    for (int i = 0; i < num_packages; i++) {
+        // lead cpu is the first cpu of the package
+        int cpu = 0;
+        while (cpu < max_cpus && cpu_package[cpu] != i) {
+            cpu++;
+        }
+        perf_ram_fds[i] = -1;
+        perf_energy_fds[i] = cpu < max_cpus ? openEnergyGroup(cpu, supported == 0, &perf_ram_fds[i]) : -1;
+        if (perf_energy_fds[i] == -1) {
+            for (int j = 0; j < i; j++) {
+                closeEnergyGroup(perf_energy_fds[j], perf_ram_fds[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_perf_source() {
+    for (int i = 0; i < num_packages; i++) {
+        closeEnergyGroup(perf_energy_fds[i], perf_ram_fds[i]);
+    }
+}
+
+// 64 bit counters scaled to microjoules, never wrap in practice
+static long long perf_range(int domain, int package) {
+    (void) package; // same on every package
+    return domain == RAPL_PKG || domain == RAPL_DRAM ? __LONG_LONG_MAX__ : 0;
+}
+
+// msr: energy status registers read with pread on /dev/cpu/<lead cpu>/msr
+static int msr_fds[RAPL_MAX_PACKAGES];
+static double msr_energy_unit[RAPL_MAX_PACKAGES]; // in microjoules
+static double msr_dram_unit[RAPL_MAX_PACKAGES];
+
+#define MSR_FIXED_DRAM_UNIT 15.3 // in microjoules
+// Intel family 6 server models whose DRAM domain ignores the energy status unit (the kernel's
+// rapl_defaults_hsw_server and _spr_server): Haswell-EP, Broadwell-EP, Skylake-SP and its
+// Cascade/Cooper Lake successors, Xeon Phi KNL/KNM, Ice Lake-SP/D, Sapphire and Emerald Rapids
+static const int fixed_dram_unit_models[] = {0x3f, 0x4f, 0x55, 0x57, 0x85, 0x6a, 0x6c, 0x8f, 0xcf};
+
+// Model number of an Intel family 6 cpu, -1 for anything else
+static int intel_cpu_model() {
+    FILE *fp = fopen(cpuinfo_path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[256];
+    int intel = 0, family = -1, model = -1;
+    // the first processor is enough, all packages are the same model
+    while (fgets(line, sizeof(line), fp) && line[0] != '\n') {
+        if (strncmp(line, "vendor_id", 9) == 0) {
+            intel = strstr(line, "GenuineIntel") != NULL;
+        } else if (strncmp(line, "cpu family", 10) == 0) {
+            sscanf(strchr(line, ':') + 1, "%d", &family);
+        } else if (strncmp(line, "model\t", 6) == 0) {
+            sscanf(strchr(line, ':') + 1, "%d", &model);
+        }
+    }
+    fclose(fp);
+    return intel && family == 6 ? model : -1;
+}
+
+static int fixed_dram_unit() {
+    int model = intel_cpu_model();
+    for (int i = 0; i < (int) (sizeof(fixed_dram_unit_models) / sizeof(fixed_dram_unit_models[0])); i++) {
+        if (model == fixed_dram_unit_models[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static long long read_msr_energy(int package, unsigned int reg) {
+    unsigned long long value;
+    if (pread(msr_fds[package], &value, sizeof(value), reg) != sizeof(value)) {
+        return 0;
+    }
+    // 32 bit counter
+    double unit = reg == MSR_DRAM_ENERGY_STATUS ? msr_dram_unit[package] : msr_energy_unit[package];
+    return (long long) ((value & 0xffffffffULL) * unit);
+}
+
+static long long read_msr(int domain, int package) {
     switch (domain) {
-        case 0: // package
-            fp = fopen(RAPL_PKG_ENERGY_FILE, "r");
-            break;
-        case 1: // cores
-            fp = fopen(RAPL_CORE_ENERGY_FILE, "r");
-            break;
-        case 2: // uncore
-            fp = fopen(RAPL_UNCORE_ENERGY_FILE, "r");
-            break;
-        case 3: // dram
-            fp = fopen(RAPL_DRAM_ENERGY_FILE, "r");
-            break;
-        case 4: // psys
-            fp = fopen(RAPL_PSYS_ENERGY_FILE, "r");
-            break;
+        case RAPL_PKG:
+            return read_msr_energy(package, MSR_PKG_ENERGY_STATUS);
+        case RAPL_CORE:
+            return read_msr_energy(package, MSR_PP0_ENERGY_STATUS);
+        case RAPL_DRAM:
+            return read_msr_energy(package, MSR_DRAM_ENERGY_STATUS);
         default:
             return 0;
     }
-    if (fp == NULL) {
+}
+
+static void read_msr_snapshot(struct energy_snapshot *snapshot) {
+    for (int i = 0; i < num_packages; i++) {
+        snapshot->pkg[i] = read_msr_energy(i, MSR_PKG_ENERGY_STATUS);
+        snapshot->dram[i] = read_msr_energy(i, MSR_DRAM_ENERGY_STATUS);
+    }
+}
+
+static int init_msr_source() {
+    char path[256];
+    int fixed_dram = fixed_dram_unit();
+    for (int i = 0; i < num_packages; i++) {
+        int cpu = 0;
+        while (cpu < max_cpus && cpu_package[cpu] != i) {
+            cpu++;
+        }
+        snprintf(path, sizeof(path), "%s/%d/msr", msr_root, cpu < max_cpus ? cpu : 0);
+        msr_fds[i] = open(path, O_RDONLY);
+        unsigned long long unit;
+        if (msr_fds[i] == -1 || pread(msr_fds[i], &unit, sizeof(unit), MSR_RAPL_POWER_UNIT) != sizeof(unit)) {
+            perror("Couldn't read msr (modprobe msr, need sudo)");
+            for (int j = 0; j <= i; j++) {
+                if (msr_fds[j] != -1) {
+                    close(msr_fds[j]);
+                }
+            }
+            return -1;
+        }
+        // energy status unit in bits 12:8, 1/2^ESU joules
+        msr_energy_unit[i] = 1e6 / (double) (1ULL << ((unit >> 8) & 0x1f));
+        msr_dram_unit[i] = fixed_dram ? MSR_FIXED_DRAM_UNIT : msr_energy_unit[i];
+    }
+    return 0;
+}
+
+static void close_msr_source() {
+    for (int i = 0; i < num_packages; i++) {
+        close(msr_fds[i]);
+    }
+}
+
+static long long msr_range(int domain, int package) {
+    if (domain != RAPL_PKG && domain != RAPL_CORE && domain != RAPL_DRAM) {
         return 0;
     }
-    fscanf(fp, "%lld", &energy_microjoules);
-    fclose(fp);
+    return (long long) (4294967296.0 * (domain == RAPL_DRAM ? msr_dram_unit[package] : msr_energy_unit[package]));
+}
+
+struct energy_source {
+    char *name;
+    int (*init)();
+    long long (*read)(int domain, int package);
+    void (*read_snapshot)(struct energy_snapshot *snapshot);
+    long long (*range)(int domain, int package); // wrap range in microjoules, 0 if not counted
+    void (*close)();
+};
+
+static struct energy_source energy_sources[] = {
+    {"powercap", init_powercap_source, read_powercap, read_powercap_snapshot, powercap_range, close_powercap_source},
+    {"perf", init_perf_source, read_perf, read_perf_snapshot, perf_range, close_perf_source},
+    {"msr", init_msr_source, read_msr, read_msr_snapshot, msr_range, close_msr_source},
+};
+#define NUM_ENERGY_SOURCES (int) (sizeof(energy_sources) / sizeof(energy_sources[0]))
+
+static int requested_source = -1; // -1 -> auto detect
+static struct energy_source *source = NULL; // active source
+
+// Choose energy source by name before init_rapl(), "auto" tries them in order,
+// "msr:<dir>" reads <dir>/<cpu>/msr and <dir>/cpuinfo instead of /dev/cpu and /proc
+int set_energy_source(const char *name) {
+    if (strncmp(name, "msr:", 4) == 0) {
+        set_msr_root(name + 4);
+        name = "msr";
+    }
+    if (strcmp(name, "auto") == 0) {
+        requested_source = -1;
+        return 0;
+    }
+    for (int i = 0; i < NUM_ENERGY_SOURCES; i++) {
+        if (strcmp(name, energy_sources[i].name) == 0) {
+            requested_source = i;
+            return 0;
+        }
+    }
+    printf("Unknown energy source %s\n", name);
+    return -1;
+}
+
+const char* energy_source_name() {
+    return source == NULL ? "none" : source->name;
+}
+
+/* ///////////////////////////////////////////
+   Virtual counters: raw register values of every domain and package
+   are folded into 64 bit totals since init_rapl(). A background tick
+   reads all of them faster than the quickest wrap at TDP, and gaps
+   that could hold more than one wrap are corrected with the recent
+   average power. Consumers only ever see monotonic totals.
+*/ ///////////////////////////////////////////
 
+struct virtual_counter {
+    long long last_raw;
+    unsigned long long last_time; // CLOCK_MONOTONIC in nanoseconds
+    long long total; // in microjoules
+    long long range; // in microjoules
+    long long max_power; // in microwatts
+    double power; // recent average in microwatts
+    int valid;
+};
+
+static struct virtual_counter counters[RAPL_NUM_TYPES][RAPL_MAX_PACKAGES];
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t tick_thread;
+static long tick_ms;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Fold a raw value into the total, caller holds counter_lock
+static long long update_counter(struct virtual_counter *counter, long long raw, unsigned long long time) {
+    if (!counter->valid) {
+        counter->last_raw = raw;
+        counter->last_time = time;
+        counter->valid = 1;
+        return counter->total;
+    }
+    double elapsed = (time - counter->last_time) * 1e-9;
+    long long delta = raw - counter->last_raw;
+    if (delta < 0) {
+        delta += counter->range;
+    }
+    // more than one wrap possible if even TDP could not have filled the range
+    if (counter->range > 0 && elapsed * counter->max_power > counter->range && counter->power > 0) {
+        long long wraps = (long long) ((counter->power * elapsed - delta) / counter->range + 0.5);
+        if (wraps > 0) {
+            delta += wraps * counter->range;
+        }
+    }
+    counter->total += delta;
+    if (elapsed > 0.005) {
+        counter->power = counter->power == 0 ? delta / elapsed : 0.8 * counter->power + 0.2 * delta / elapsed;
+    }
+    counter->last_raw = raw;
+    counter->last_time = time;
+    return counter->total;
+}
+
+// TDP of the zone or its package, powercap only knows it
+static long long domain_max_power(int domain, int package) {
+    int index = domain_index[domain][package];
+    if (index != -1 && rapl_domains[index].max_power > 0) {
+        return rapl_domains[index].max_power;
+    }
+    index = domain_index[RAPL_PKG][package];
+    if (index != -1 && rapl_domains[index].max_power > 0) {
+        return rapl_domains[index].max_power;
+    }
+    return DEFAULT_MAX_POWER;
+}
+
+static void update_all_counters() {
+    struct energy_snapshot raw;
+    pthread_mutex_lock(&counter_lock);
+    unsigned long long time = now_ns();
+    source->read_snapshot(&raw);
+    for (int p = 0; p < num_packages; p++) {
+        for (int d = 0; d < RAPL_NUM_TYPES; d++) {
+            if (counters[d][p].range == 0) {
+                continue;
+            }
+            long long value = d == RAPL_PKG ? raw.pkg[p] : d == RAPL_DRAM ? raw.dram[p] : source->read(d, p);
+            update_counter(&counters[d][p], value, time);
+        }
+    }
+    pthread_mutex_unlock(&counter_lock);
+}
+
+static void* tick_thread_func() {
+    struct timespec period = {tick_ms / 1000, (tick_ms % 1000) * 1000000L};
+    while (1) {
+        nanosleep(&period, NULL);
+        update_all_counters();
+    }
+    return NULL;
+}
+
+// Set up counters of the active source, tick at a quarter of the fastest wrap time
+static int init_virtual_counters() {
+    double fastest_wrap = MAX_TICK_MS / 1000.0;
+    for (int p = 0; p < num_packages; p++) {
+        for (int d = 0; d < RAPL_NUM_TYPES; d++) {
+            struct virtual_counter *counter = &counters[d][p];
+            memset(counter, 0, sizeof(*counter));
+            counter->range = source->range(d, p);
+            if (counter->range == 0) {
+                continue;
+            }
+            counter->max_power = domain_max_power(d, p);
+            double wrap = (double) counter->range / counter->max_power;
+            if (wrap < fastest_wrap) {
+                fastest_wrap = wrap;
+            }
+        }
+    }
+    tick_ms = fastest_wrap * 1000 / 4;
+    tick_ms = tick_ms < MIN_TICK_MS ? MIN_TICK_MS : tick_ms > MAX_TICK_MS ? MAX_TICK_MS : tick_ms;
+    update_all_counters();
+    if (pthread_create(&tick_thread, NULL, tick_thread_func, NULL) != 0) {
+        printf("Couldn't start energy counter thread\n");
+        return -1;
+    }
+    pthread_detach(tick_thread);
+    return 0;
+}
+
+// 0->pkg, 1->cores, 2->uncore, 3->dram, 4->psys of one package (psys has only package 0),
+// microjoules since init_rapl()
+long long read_energy_package(int domain, int package) {
+    if (source == NULL || domain < 0 || domain >= RAPL_NUM_TYPES
+            || package < 0 || package >= RAPL_MAX_PACKAGES || counters[domain][package].range == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&counter_lock);
+    unsigned long long time = now_ns();
+    long long total = update_counter(&counters[domain][package], source->read(domain, package), time);
+    pthread_mutex_unlock(&counter_lock);
+    return total;
+}
+
+// Summed over all packages
+long long read_energy(int domain) {
+    long long energy_microjoules = 0;
+    for (int i = 0; i < num_packages; i++) {
+        energy_microjoules += read_energy_package(domain, i);
+    }
     return energy_microjoules;
 }
 
-// msr overflow checking and fixing
+void read_energy_snapshot(struct energy_snapshot *snapshot) {
+    struct energy_snapshot raw;
+    if (source == NULL) {
+        memset(snapshot, 0, sizeof(*snapshot));
+        return;
+    }
+    pthread_mutex_lock(&counter_lock);
+    unsigned long long time = now_ns();
+    source->read_snapshot(&raw);
+    for (int i = 0; i < num_packages; i++) {
+        snapshot->pkg[i] = update_counter(&counters[RAPL_PKG][i], raw.pkg[i], time);
+        snapshot->dram[i] = counters[RAPL_DRAM][i].range == 0 ? 0
+                : update_counter(&counters[RAPL_DRAM][i], raw.dram[i], time);
+    }
+    pthread_mutex_unlock(&counter_lock);
+}
+
+// pkg of one package between two snapshots, dram is attributed separately
+long long energy_interval_package(struct energy_snapshot *before, struct energy_snapshot *after,
+        int package)
+{
+    return check_overflow(before->pkg[package], after->pkg[package]);
+}
+
+// dram of all packages between two snapshots
+long long energy_interval_dram(struct energy_snapshot *before, struct energy_snapshot *after) {
+    long long total = 0;
+    for (int i = 0; i < num_packages; i++) {
+        total += check_overflow(before->dram[i], after->dram[i]);
+    }
+    return total;
+}
+
+// pkg + dram of all packages
+long long energy_interval_total(struct energy_snapshot *before, struct energy_snapshot *after) {
+    long long total = 0;
+    for (int i = 0; i < num_packages; i++) {
+        total += energy_interval_package(before, after, i);
+    }
+    return total + energy_interval_dram(before, after);
+}
+
+int cpu_to_package(int cpu) {
+    if (cpu < 0 || cpu >= max_cpus) {
+        return 0;
+    }
+    return cpu_package[cpu];
+}
+
+// msr overflow checking and fixing, values from read_energy*() are monotonic already
 long long check_overflow(long long before, long long after) {
     if (before > after) {
         return (after + max_range - before);
@@ -61,62 +536,506 @@ long long check_overflow(long long before, long long after) {
     return after - before;
 }
 
-// check available rapl domains, packages, set max_range overflow, 
-int init_rapl() {
-    // Check if config_idle.txt file exists
-    if (access("config_idle.txt", F_OK) != -1) {
-        // File exists, read its contents
-        FILE *fp = fopen("config_idle.txt", "r");
-        if (fp == NULL) {
-            perror("Couldn't open config_idle.txt file");
-            return -1;
-        }
-        fscanf(fp, "%lld %lld", &idle_consumption, &idle_min);
-        printf("Idle power config (microjoules per 1 second): %lld\n", idle_consumption);
-        fclose(fp);
+static int read_zone_file(const char *zone, const char *file, char *buf, size_t size) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s/%s", zone, file);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return len;
+}
+
+// Register zone directory, returns package id for its sub-zones
+static int add_zone(const char *zone, int package) {
+    char buf[64];
+    if (num_rapl_domains == RAPL_MAX_DOMAINS) {
+        return package;
+    }
+    if (read_zone_file(zone, "name", buf, sizeof(buf)) == -1) {
+        return package;
+    }
+    struct rapl_domain *domain = &rapl_domains[num_rapl_domains];
+    // not a zone name we know if it doesn't fit
+    if (snprintf(domain->name, sizeof(domain->name), "%s", buf) >= (int) sizeof(domain->name)
+            || snprintf(domain->path, sizeof(domain->path), "%s", zone) >= (int) sizeof(domain->path)) {
+        return package;
+    }
+
+    if (strncmp(buf, "package-", 8) == 0) {
+        domain->type = RAPL_PKG;
+        package = atoi(buf + 8);
+    } else if (strcmp(buf, "core") == 0) {
+        domain->type = RAPL_CORE;
+    } else if (strcmp(buf, "uncore") == 0) {
+        domain->type = RAPL_UNCORE;
+    } else if (strcmp(buf, "dram") == 0) {
+        domain->type = RAPL_DRAM;
+    } else if (strcmp(buf, "psys") == 0) {
+        domain->type = RAPL_PSYS;
+        package = -1;
     } else {
-        // File does not exist
+        domain->type = RAPL_OTHER;
+    }
+    domain->package = package;
+
+    domain->max_range = 0;
+    if (read_zone_file(zone, "max_energy_range_uj", buf, sizeof(buf)) > 0) {
+        domain->max_range = parse_uj(buf, strlen(buf));
+    }
+    domain->max_power = 0;
+    if (read_zone_file(zone, "constraint_0_max_power_uw", buf, sizeof(buf)) > 0) {
+        domain->max_power = parse_uj(buf, strlen(buf));
+    }
+    if (domain->max_power == 0 && read_zone_file(zone, "constraint_0_power_limit_uw", buf, sizeof(buf)) > 0) {
+        domain->max_power = parse_uj(buf, strlen(buf));
+    }
+
+    char path[320];
+    snprintf(path, sizeof(path), "%s/energy_uj", zone);
+    domain->fd = open(path, O_RDONLY);
+    if (domain->fd == -1) {
+        perror("Couldn't open energy_uj (init_rapl). Need sudo");
+        return package;
+    }
+    num_rapl_domains++;
+
+    // psys has no package, keep it at slot 0 so read_energy(4) finds it
+    int slot = package == -1 ? 0 : package;
+    if (slot >= 0 && slot < RAPL_MAX_PACKAGES && domain_index[domain->type][slot] == -1) {
+        domain_index[domain->type][slot] = num_rapl_domains - 1;
+    }
+    return package;
+}
+
+// Zones are directories named <parent>:<n>, sub-zones nest inside their zone
+static void scan_zones(const char *dir, const char *prefix, int package) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    size_t prefix_len = strlen(prefix);
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0 || entry->d_name[prefix_len] != ':') {
+            continue;
+        }
+        char zone[256];
+        if (snprintf(zone, sizeof(zone), "%s/%s", dir, entry->d_name) >= (int) sizeof(zone)) {
+            continue;
+        }
+        int zone_package = add_zone(zone, package);
+        scan_zones(zone, entry->d_name, zone_package);
+    }
+    closedir(d);
+}
+
+// Walk powercap once, intel-rapl and amd-rapl control types with all their sub-zones
+static int discover_domains() {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s%s", sysfs_root, POWERCAP_DIR);
+    memset(domain_index, -1, sizeof(domain_index));
+    num_rapl_domains = 0;
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("No powercap");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        // intel-rapl-mmio reports the same package energy again
+        if (strstr(entry->d_name, "rapl") == NULL || strstr(entry->d_name, "mmio") != NULL
+                || strchr(entry->d_name, ':') != NULL) {
+            continue;
+        }
+        char control_type[256];
+        if (snprintf(control_type, sizeof(control_type), "%s/%s", dir, entry->d_name) >= (int) sizeof(control_type)) {
+            continue;
+        }
+        scan_zones(control_type, entry->d_name, 0);
+    }
+    closedir(d);
+    return num_rapl_domains;
+}
+
+// Map every cpu to its socket, cpus without topology information count as package 0
+static int map_cpu_packages() {
+    char path[256];
+    char buf[16];
+    max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    cpu_package = malloc(sizeof(int) * max_cpus);
+    if (cpu_package == NULL) {
+        printf("Cpu package array allocation failed.\n");
+        return -1;
+    }
+    for (int i = 0; i < max_cpus; i++) {
+        cpu_package[i] = 0;
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/topology", sysfs_root, i);
+        if (read_zone_file(path, "physical_package_id", buf, sizeof(buf)) > 0) {
+            int package = atoi(buf);
+            if (package > 0 && package < RAPL_MAX_PACKAGES) {
+                cpu_package[i] = package;
+            }
+        }
+        if (cpu_package[i] + 1 > num_packages) {
+            num_packages = cpu_package[i] + 1;
+        }
+    }
+    return 0;
+}
+
+/* ///////////////////////////////////////////
+   Idle calibration: power samples every IDLE_SAMPLE_MS with running
+   Welford mean/variance per domain and package, stops once the 95%
+   confidence interval of the total is within bound * mean.
+   config_idle.txt lines: domain package samples mean stddev min p5 p50 p95
+   (microwatts), old files with just mean and min are still read.
+*/ ///////////////////////////////////////////
+
+#define IDLE_SAMPLE_MS 100
+#define IDLE_MIN_SAMPLES 50
+#define IDLE_MAX_SECONDS 180
+
+struct welford {
+    long long n;
+    double mean;
+    double m2;
+    double min;
+    double *values; // kept for percentiles
+};
+
+static void welford_add(struct welford *w, double x) {
+    w->values[w->n] = x;
+    w->n++;
+    double delta = x - w->mean;
+    w->mean += delta / w->n;
+    w->m2 += delta * (x - w->mean);
+    if (w->n == 1 || x < w->min) {
+        w->min = x;
+    }
+}
+
+static double welford_stddev(struct welford *w) {
+    return w->n > 1 ? sqrt(w->m2 / (w->n - 1)) : 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void welford_to_stats(struct welford *w, struct idle_stats *stats) {
+    stats->samples = w->n;
+    stats->mean = w->mean;
+    stats->stddev = welford_stddev(w);
+    stats->min = w->min;
+    qsort(w->values, w->n, sizeof(double), compare_double);
+    stats->p5 = w->values[(w->n - 1) * 5 / 100];
+    stats->p50 = w->values[(w->n - 1) / 2];
+    stats->p95 = w->values[(w->n - 1) * 95 / 100];
+}
+
+static void print_idle_stats(FILE *fp, char *domain, int package, struct idle_stats *stats) {
+    fprintf(fp, "%s %d %lld %.0f %.0f %.0f %.0f %.0f %.0f\n", domain, package, stats->samples,
+            stats->mean, stats->stddev, stats->min, stats->p5, stats->p50, stats->p95);
+}
+
+// Read config_idle.txt, old format is mean and min of the total
+static int load_idle_profile() {
+    FILE *fp = fopen("config_idle.txt", "r");
+    if (fp == NULL) {
         printf("No idle power config file present, run with -i on idle system\n");
+        return -1;
     }
+    char line[256];
+    char domain[16];
+    int package;
+    struct idle_stats stats;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] >= '0' && line[0] <= '9') { // old format
+            long long min = 0;
+            idle_total.mean = atoll(line);
+            if (fgets(line, sizeof(line), fp)) {
+                min = atoll(line);
+            }
+            idle_total.min = min;
+            idle_total.p5 = min;
+            break;
+        }
+        if (sscanf(line, "%15s %d %lld %lf %lf %lf %lf %lf %lf", domain, &package, &stats.samples,
+                &stats.mean, &stats.stddev, &stats.min, &stats.p5, &stats.p50, &stats.p95) != 9) {
+            continue;
+        }
+        if (strcmp(domain, "total") == 0) {
+            idle_total = stats;
+        } else if (package >= 0 && package < RAPL_MAX_PACKAGES && strcmp(domain, "pkg") == 0) {
+            idle_pkg[package] = stats;
+            idle_per_package = 1;
+        } else if (package >= 0 && package < RAPL_MAX_PACKAGES && strcmp(domain, "dram") == 0) {
+            idle_dram[package] = stats;
+        }
+    }
+    fclose(fp);
+    // 5th percentile as lower bound, single samples are too noisy for the minimum
+    idle_consumption = idle_total.mean;
+    idle_min = idle_total.p5;
+    idle_dram_consumption = 0;
+    idle_dram_min = 0;
+    for (int i = 0; i < RAPL_MAX_PACKAGES && idle_per_package; i++) {
+        idle_dram_consumption += idle_dram[i].mean;
+        idle_dram_min += idle_dram[i].p5;
+    }
+    printf("Idle power config (microjoules per 1 second): %lld\n", idle_consumption);
+    return 0;
+}
 
-    // max range
-    FILE *fp;
-    fp = fopen(RAPL_MAX_RANGE, "r");
+// Calibrate on an idle system until the confidence interval is within bound (relative to mean)
+int calibrate_idle(double bound) {
+    int max_samples = IDLE_MAX_SECONDS * 1000 / IDLE_SAMPLE_MS;
+    int series = 2 * num_packages + 1; // total, pkg and dram per package
+    struct welford *w = calloc(series, sizeof(struct welford));
+    double *values = malloc(sizeof(double) * max_samples * series);
+    if (w == NULL || values == NULL) {
+        printf("Calibration allocation failed.\n");
+        free(values);
+        free(w);
+        return -1;
+    }
+    for (int i = 0; i < series; i++) {
+        w[i].values = values + i * max_samples;
+    }
+    struct welford *total = &w[0];
+    struct welford *pkg = &w[1];
+    struct welford *dram = &w[1 + num_packages];
+
+    struct energy_snapshot before, after;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    read_energy_snapshot(&before);
+    double seconds = IDLE_SAMPLE_MS / 1000.0;
+    while (total->n < max_samples) {
+        next.tv_nsec += IDLE_SAMPLE_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        read_energy_snapshot(&after);
+        double total_power = 0;
+        for (int i = 0; i < num_packages; i++) {
+            double pkg_power = check_overflow(before.pkg[i], after.pkg[i]) / seconds;
+            double dram_power = check_overflow(before.dram[i], after.dram[i]) / seconds;
+            welford_add(&pkg[i], pkg_power);
+            welford_add(&dram[i], dram_power);
+            total_power += pkg_power + dram_power;
+        }
+        welford_add(total, total_power);
+        before = after;
+
+        // 95% confidence interval of the mean
+        double half_width = 1.96 * welford_stddev(total) / sqrt(total->n);
+        if (total->n >= IDLE_MIN_SAMPLES && half_width <= bound * total->mean) {
+            break;
+        }
+    }
+
+    struct idle_stats stats;
+    FILE *fp = fopen("config_idle.txt", "w");
     if (fp == NULL) {
-        perror("Couldn't get filehandle (read_energy). Need sudo");
+        perror("Couldn't write config_idle.txt file");
+        free(values);
+        free(w);
         return -1;
     }
-    fscanf(fp, "%llu", &max_range);
+    fprintf(fp, "# domain package samples mean stddev min p5 p50 p95 (microwatts)\n");
+    welford_to_stats(total, &stats);
+    print_idle_stats(fp, "total", -1, &stats);
+    printf("New idle energy consumption (microjoules per second): %.0f, +-%.0f after %lld samples\n",
+            stats.mean, 1.96 * stats.stddev / sqrt(stats.samples), stats.samples);
+    for (int i = 0; i < num_packages; i++) {
+        welford_to_stats(&pkg[i], &stats);
+        print_idle_stats(fp, "pkg", i, &stats);
+        welford_to_stats(&dram[i], &stats);
+        print_idle_stats(fp, "dram", i, &stats);
+    }
     fclose(fp);
+    free(values);
+    free(w);
+    return 0;
+}
+
+// check available rapl domains, packages, set max_range overflow, 
+int init_rapl() {
+    load_idle_profile();
+
+    discover_domains();
+    for (int i = 0; i < num_rapl_domains; i++) {
+        if (rapl_domains[i].package + 1 > num_packages) {
+            num_packages = rapl_domains[i].package + 1;
+        }
+    }
+    if (map_cpu_packages() == -1) {
+        return -1;
+    }
+
+    // requested energy source, or the first one that works
+    for (int i = 0; i < NUM_ENERGY_SOURCES && source == NULL; i++) {
+        if (requested_source != -1 && requested_source != i) {
+            continue;
+        }
+        if (energy_sources[i].init() == 0) {
+            source = &energy_sources[i];
+        }
+    }
+    if (source == NULL) {
+        printf("No energy source available. Need sudo\n");
+        return -1;
+    }
+    printf("Energy source: %s\n", source->name);
+    // max range
+    max_range = source->range(RAPL_PKG, 0);
+    if (init_virtual_counters() == -1) {
+        return -1;
+    }
     
     return 0;
 }
 
-// Use statistics to estimate consumed energy in microjoules
-long long estimate_energy_cycles(long long cpu_cycles, long long cpu_cycles_proc,
-        long long energy_interval, double time)
-{
-    long long energy_estimation = 0;
-    double idle_contribution = idle_consumption * time;
+// Read pkg and dram from every available source over the same interval and print them
+int cross_check_energy_sources(int seconds) {
+    struct energy_snapshot before[NUM_ENERGY_SOURCES], after[NUM_ENERGY_SOURCES];
+    int available[NUM_ENERGY_SOURCES];
+
+    for (int i = 0; i < NUM_ENERGY_SOURCES; i++) {
+        available[i] = source == &energy_sources[i] || energy_sources[i].init() == 0;
+        if (available[i]) {
+            energy_sources[i].read_snapshot(&before[i]);
+        }
+    }
+    sleep(seconds);
+    for (int i = 0; i < NUM_ENERGY_SOURCES; i++) {
+        if (available[i]) {
+            energy_sources[i].read_snapshot(&after[i]);
+        }
+    }
+    // Only opened for the check
+    for (int i = 0; i < NUM_ENERGY_SOURCES; i++) {
+        if (available[i] && source != &energy_sources[i]) {
+            energy_sources[i].close();
+        }
+    }
+    for (int p = 0; p < num_packages; p++) {
+        for (int i = 0; i < NUM_ENERGY_SOURCES; i++) {
+            if (!available[i]) {
+                printf("Package %d %s: not available\n", p, energy_sources[i].name);
+                continue;
+            }
+            long long pkg = after[i].pkg[p] - before[i].pkg[p];
+            long long dram = after[i].dram[p] - before[i].dram[p];
+            pkg += pkg < 0 ? energy_sources[i].range(RAPL_PKG, p) : 0;
+            dram += dram < 0 ? energy_sources[i].range(RAPL_DRAM, p) : 0;
+            printf("Package %d %s: pkg %lld, dram %lld (microjoules)\n", p, energy_sources[i].name, pkg, dram);
+        }
+    }
+    return 0;
+}
+
+// Energy left after idle, idle and idle_minimum in microjoules per second
+static long long above_idle(long long energy_interval, double time, long long idle, long long idle_minimum) {
+    double idle_contribution = idle * time;
     // if idle avg is higher than measured use minium val
     if (idle_contribution > energy_interval) {
-        idle_contribution = idle_min * time;
+        idle_contribution = idle_minimum * time;
         // if min value is still higher than measured return 0
         if (idle_contribution > energy_interval) {
             return 0;
         }
     }
+    return energy_interval - idle_contribution;
+}
+
+// Measured package energy minus its idle consumption, what attribution models split up
+long long dynamic_energy(long long energy_interval, double time) {
+    return above_idle(energy_interval, time, idle_consumption - idle_dram_consumption,
+            idle_min - idle_dram_min);
+}
+
+// Cycle fraction of the energy left after idle
+static long long estimate_share(long long cpu_cycles, long long cpu_cycles_proc,
+        long long energy_interval, double time, long long idle, long long idle_minimum)
+{
+    long long energy_estimation = 0;
     // compute fraction
-    if (cpu_cycles_proc==0) {
+    if (cpu_cycles_proc==0 || cpu_cycles==0) {
         //printf("sys_cycles %lld - proc_cycles %lld - fraction %.6f \n", cpu_cycles, cpu_cycles_proc, 0.0);
         return 0;
     }
     double cpu_cycles_frac = (double) cpu_cycles_proc / cpu_cycles;
     //printf("sys_cycles %lld - proc_cycles %lld - fraction %.6f \n", cpu_cycles, cpu_cycles_proc, cpu_cycles_frac);
-    energy_estimation = cpu_cycles_frac * (energy_interval - idle_contribution);
+    energy_estimation = cpu_cycles_frac * above_idle(energy_interval, time, idle, idle_minimum);
     return energy_estimation;
 }
 
+// Use statistics to estimate consumed energy in microjoules
+long long estimate_energy_cycles(long long cpu_cycles, long long cpu_cycles_proc,
+        long long energy_interval, double time)
+{
+    return estimate_share(cpu_cycles, cpu_cycles_proc, energy_interval, time,
+            idle_consumption - idle_dram_consumption, idle_min - idle_dram_min);
+}
+
+// Per package: cycles that ran on a socket only get a share of that socket's energy
+long long estimate_energy_cycles_packages(long long *cpu_cycles, long long *cpu_cycles_proc,
+        long long *energy_interval, double time)
+{
+    long long energy_estimation = 0;
+    for (int i = 0; i < num_packages; i++) {
+        long long idle = (idle_consumption - idle_dram_consumption) / num_packages;
+        long long idle_minimum = (idle_min - idle_dram_min) / num_packages;
+        if (idle_per_package) {
+            idle = idle_pkg[i].mean;
+            idle_minimum = idle_pkg[i].p5;
+        }
+        energy_estimation += estimate_share(cpu_cycles[i], cpu_cycles_proc[i], energy_interval[i],
+                time, idle, idle_minimum);
+    }
+    return energy_estimation;
+}
+
+// DRAM energy of an entity: the idle part (refresh) by its share of the used memory, the rest by its
+// share of the memory traffic, e.g. LLC misses. A negative entity value is unknown, the other share
+// is used for all of it then.
+long long estimate_energy_dram(long long traffic, long long traffic_entity, long long memory,
+        long long memory_entity, long long dram_interval, double time)
+{
+    double traffic_share = traffic_entity >= 0 && traffic > 0 ? (double) traffic_entity / traffic : -1;
+    double memory_share = memory_entity >= 0 && memory > 0 ? (double) memory_entity / memory : -1;
+    traffic_share = traffic_share > 1 ? 1 : traffic_share;
+    memory_share = memory_share > 1 ? 1 : memory_share;
+    if (traffic_share < 0 && memory_share < 0) {
+        return 0;
+    }
+    if (traffic_share < 0) {
+        return memory_share * dram_interval;
+    }
+    if (memory_share < 0) {
+        return traffic_share * dram_interval;
+    }
+    long long idle = idle_dram_consumption * time;
+    if (idle > dram_interval) {
+        idle = dram_interval;
+    }
+    return memory_share * idle + traffic_share * (dram_interval - idle);
+}
+
 /*
 
 long long estimate_energy_cputime(unsigned long cputime, unsigned long cputime_proc,
@@ -148,3 +1067,32 @@ long long estimate_energy(unsigned long cputime, long rss, long io_op, long long
     return energy_estimation;
 }
 // */
+
+/* testing, fake tree with two packages, e.g.
+   <root>/devices/virtual/powercap/intel-rapl/intel-rapl:N/{name,energy_uj,max_energy_range_uj}
+   <root>/devices/virtual/powercap/intel-rapl/intel-rapl:N/intel-rapl:N:0/{name,energy_uj} (dram)
+   <root>/devices/system/cpu/cpuX/topology/physical_package_id
+int main(int argc, char **argv)
+{
+    struct energy_snapshot before, after;
+    set_sysfs_root(argv[1]);
+    if (init_rapl() == -1) {
+        return 1;
+    }
+    for (int i = 0; i < num_rapl_domains; i++) {
+        printf("%s: %s type %d package %d\n", rapl_domains[i].path, rapl_domains[i].name,
+                rapl_domains[i].type, rapl_domains[i].package);
+    }
+    read_energy_snapshot(&before);
+    sleep(1); // change energy_uj files in the meantime
+    read_energy_snapshot(&after);
+    long long cycles[RAPL_MAX_PACKAGES] = {100, 100};
+    long long cycles_proc[RAPL_MAX_PACKAGES] = {50, 0};
+    long long energy[RAPL_MAX_PACKAGES];
+    for (int i = 0; i < num_packages; i++) {
+        energy[i] = energy_interval_package(&before, &after, i);
+        printf("Package %d: %lld microjoules\n", i, energy[i]);
+    }
+    printf("Estimated: %lld\n", estimate_energy_cycles_packages(cycles, cycles_proc, energy, 1.0));
+}
+// */
@@ -1,21 +1,99 @@
 #ifndef energy_h
 #define energy_h
 
+#define RAPL_MAX_DOMAINS 64
+#define RAPL_MAX_PACKAGES 16
+
+// domain types, same numbering as read_energy() always used
+#define RAPL_PKG 0
+#define RAPL_CORE 1
+#define RAPL_UNCORE 2
+#define RAPL_DRAM 3
+#define RAPL_PSYS 4
+#define RAPL_OTHER 5
+#define RAPL_NUM_TYPES 6
+
+struct rapl_domain {
+    char name[32]; // powercap zone name, e.g. package-0, core, dram
+    char path[256]; // zone directory
+    int type; // RAPL_PKG ... RAPL_OTHER
+    int package; // package id of the zone, -1 for psys
+    int fd; // energy_uj, kept open and read with pread
+    long long max_range; // in microjoules
+    long long max_power; // TDP in microwatts, 0 if unknown
+};
+
+// idle power of one domain, in microwatts
+struct idle_stats {
+    long long samples;
+    double mean;
+    double stddev;
+    double min;
+    double p5;
+    double p50;
+    double p95;
+};
+
+extern struct rapl_domain rapl_domains[RAPL_MAX_DOMAINS];
+
+extern int num_rapl_domains;
+
+extern int num_packages;
+
+// pkg and dram counters of every package, in microjoules
+struct energy_snapshot {
+    long long pkg[RAPL_MAX_PACKAGES];
+    long long dram[RAPL_MAX_PACKAGES];
+};
+
+void set_sysfs_root(const char *root);
+
+void set_msr_root(const char *root);
+
+int set_energy_source(const char *name);
+
+const char* energy_source_name();
+
+int cross_check_energy_sources(int seconds);
+
 long long read_energy(int domain);
 
+long long read_energy_package(int domain, int package);
+
+void read_energy_snapshot(struct energy_snapshot *snapshot);
+
+long long energy_interval_package(struct energy_snapshot *before, struct energy_snapshot *after,
+        int package);
+
+long long energy_interval_dram(struct energy_snapshot *before, struct energy_snapshot *after);
+
+long long energy_interval_total(struct energy_snapshot *before, struct energy_snapshot *after);
+
+int cpu_to_package(int cpu);
+
 long long check_overflow(long long before, long long after);
 
 int init_rapl();
 
+int calibrate_idle(double bound);
+
+long long dynamic_energy(long long energy_interval, double time);
+
 long long estimate_energy_cycles(long long cpu_cycles, long long cpu_cycles_proc,
         long long energy_interval, double time);
 
+long long estimate_energy_cycles_packages(long long *cpu_cycles, long long *cpu_cycles_proc,
+        long long *energy_interval, double time);
+
+long long estimate_energy_dram(long long traffic, long long traffic_entity, long long memory,
+        long long memory_entity, long long dram_interval, double time);
+
 /*
 double estimate_energy_cputime(unsigned long cputime, unsigned long cputime_proc,
         long long energy_interval);
         
 
-/* double estimate_energy(unsigned long cputime, long rss, long io_op, long long cpu_cycles, 
+double estimate_energy(unsigned long cputime, long rss, long io_op, long long cpu_cycles, 
         unsigned long cputime_proc, long rss_proc, long io_op_proc, long long cpu_cycles_proc,
         long long energy_interval);
 */
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include "energy.h"
+#include "energy_model.h"
+
+/* ///////////////////////////////////////////
+   Attribution models split the measured energy of an interval
+   between processes, containers or cgroups by their counters.
+   cycles: baseline, share of cpu cycles (estimate_energy_cycles)
+   regression: recursive least squares fit of RAPL energy against
+   the system-wide counters, updated every interval. Entities get
+   the dynamic energy weighted by the fitted per-counter cost.
+*/ ///////////////////////////////////////////
+
+#define RLS_SIZE (MODEL_FEATURES + 1) // counters + time for the idle part
+#define RLS_LAMBDA 0.99 // forgetting factor, older intervals fade out
+#define RLS_DELTA 1e8 // initial covariance, also the bound of its diagonal
+#define RLS_MIN_UPDATES (2 * RLS_SIZE) // fall back to cycles before
+
+// counters are scaled to roughly 1 per second to keep the fit conditioned
+static const double feature_scale[MODEL_FEATURES] = {1e9, 1e9, 1e6, 1e3, 1e6};
+
+static double weights[RLS_SIZE]; // microjoules per scaled counter, last one per second
+static double covariance[RLS_SIZE][RLS_SIZE];
+static long long updates = 0;
+
+struct energy_model {
+    char *name;
+    void (*update)(struct model_counters *system, long long energy_interval, double time);
+    long long (*estimate)(struct model_counters *system, struct model_counters *entity,
+            long long energy_interval, double time);
+};
+
+static void update_cycles(struct model_counters *system, long long energy_interval, double time) {
+    // nothing to learn
+    (void) system;
+    (void) energy_interval;
+    (void) time;
+}
+
+static long long estimate_cycles(struct model_counters *system, struct model_counters *entity,
+        long long energy_interval, double time)
+{
+    return estimate_energy_cycles(system->values[MODEL_CYCLES], entity->values[MODEL_CYCLES],
+            energy_interval, time);
+}
+
+static void rls_reset() {
+    memset(weights, 0, sizeof(weights));
+    memset(covariance, 0, sizeof(covariance));
+    for (int i = 0; i < RLS_SIZE; i++) {
+        covariance[i][i] = RLS_DELTA;
+    }
+    updates = 0;
+}
+
+static void update_regression(struct model_counters *system, long long energy_interval, double time) {
+    double x[RLS_SIZE];
+    double px[RLS_SIZE]; // P x
+    double gain[RLS_SIZE];
+
+    if (updates == 0) {
+        rls_reset();
+    }
+    for (int i = 0; i < MODEL_FEATURES; i++) {
+        x[i] = system->values[i] / feature_scale[i];
+    }
+    x[MODEL_FEATURES] = time;
+
+    double denominator = RLS_LAMBDA;
+    for (int i = 0; i < RLS_SIZE; i++) {
+        px[i] = 0;
+        for (int j = 0; j < RLS_SIZE; j++) {
+            px[i] += covariance[i][j] * x[j];
+        }
+        denominator += x[i] * px[i];
+    }
+    double error = energy_interval;
+    for (int i = 0; i < RLS_SIZE; i++) {
+        gain[i] = px[i] / denominator;
+        error -= weights[i] * x[i];
+    }
+    for (int i = 0; i < RLS_SIZE; i++) {
+        weights[i] += gain[i] * error;
+    }
+    // P = (P - k (P x)^T) / lambda, kept symmetric against rounding
+    double trace = 0;
+    int positive = 1;
+    for (int i = 0; i < RLS_SIZE; i++) {
+        for (int j = i; j < RLS_SIZE; j++) {
+            covariance[i][j] = (covariance[i][j] - (gain[i] * px[j] + gain[j] * px[i]) / 2) / RLS_LAMBDA;
+            covariance[j][i] = covariance[i][j];
+        }
+        trace += covariance[i][i];
+        positive = positive && covariance[i][i] > 0;
+    }
+    // Directions without excitation (an idle counter, e.g. LLC misses of pure compute, or memory
+    // that moves with time) grow by 1/lambda every interval until inf and NaN weights. Past the
+    // initial uncertainty, or once rounding broke it, the covariance starts over, the weights stay.
+    if (trace > RLS_SIZE * RLS_DELTA || !positive || trace != trace) {
+        memset(covariance, 0, sizeof(covariance));
+        for (int i = 0; i < RLS_SIZE; i++) {
+            covariance[i][i] = RLS_DELTA;
+        }
+    }
+    updates++;
+}
+
+// Fitted cost of the counters the entity has, negative weights carry no energy
+static double fitted_cost(struct model_counters *counters, struct model_counters *entity) {
+    double cost = 0;
+    for (int i = 0; i < MODEL_FEATURES; i++) {
+        if (weights[i] > 0 && entity->values[i] >= 0) {
+            cost += weights[i] * counters->values[i] / feature_scale[i];
+        }
+    }
+    return cost;
+}
+
+static long long estimate_regression(struct model_counters *system, struct model_counters *entity,
+        long long energy_interval, double time)
+{
+    double system_cost = fitted_cost(system, entity);
+    if (updates < RLS_MIN_UPDATES || system_cost <= 0) {
+        return estimate_cycles(system, entity, energy_interval, time);
+    }
+    // entity counters can't exceed the system-wide ones, e.g. io syscalls vs disk operations
+    struct model_counters clamped = *entity;
+    for (int i = 0; i < MODEL_FEATURES; i++) {
+        if (clamped.values[i] > system->values[i]) {
+            clamped.values[i] = system->values[i];
+        }
+    }
+    double fraction = fitted_cost(&clamped, entity) / system_cost;
+    return fraction * dynamic_energy(energy_interval, time);
+}
+
+static struct energy_model energy_models[] = {
+    {"cycles", update_cycles, estimate_cycles},
+    {"regression", update_regression, estimate_regression},
+};
+#define NUM_ENERGY_MODELS (int) (sizeof(energy_models) / sizeof(energy_models[0]))
+
+static struct energy_model *model = &energy_models[0];
+
+int set_energy_model(const char *name) {
+    for (int i = 0; i < NUM_ENERGY_MODELS; i++) {
+        if (strcmp(name, energy_models[i].name) == 0) {
+            model = &energy_models[i];
+            return 0;
+        }
+    }
+    printf("Unknown energy model %s\n", name);
+    return -1;
+}
+
+const char* energy_model_name() {
+    return model->name;
+}
+
+// cycles only model, callers with per-socket cycles can use estimate_energy_cycles_packages
+int energy_model_is_baseline() {
+    return model == &energy_models[0];
+}
+
+void update_energy_model(struct model_counters *system, long long energy_interval, double time) {
+    model->update(system, energy_interval, time);
+}
+
+long long estimate_energy_model(struct model_counters *system, struct model_counters *entity,
+        long long energy_interval, double time)
+{
+    return model->estimate(system, entity, energy_interval, time);
+}
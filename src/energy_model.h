@@ -0,0 +1,27 @@
+#ifndef energy_model_h
+#define energy_model_h
+
+// per-entity and system-wide counters of one interval, negative if not counted for an entity
+#define MODEL_CYCLES 0
+#define MODEL_INSTRUCTIONS 1
+#define MODEL_LLC_MISSES 2
+#define MODEL_IO_OP 3
+#define MODEL_MEMORY 4 // in kB
+#define MODEL_FEATURES 5
+
+struct model_counters {
+    double values[MODEL_FEATURES];
+};
+
+int set_energy_model(const char *name);
+
+const char* energy_model_name();
+
+int energy_model_is_baseline();
+
+void update_energy_model(struct model_counters *system, long long energy_interval, double time);
+
+long long estimate_energy_model(struct model_counters *system, struct model_counters *entity,
+        long long energy_interval, double time);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "energy.h"
+#include "energy_sampler.h"
+
+/* ///////////////////////////////////////////
+   Sampler thread reads pkg and dram of every package each 1-10 ms
+   into a single-producer/single-consumer ring. Samples carry the
+   virtual counter totals of read_energy_snapshot, so dropped samples
+   (full ring) only cost resolution, never energy, and a window may
+   mix a sample with a plain read. The consumer interpolates the
+   totals at exact CLOCK_MONOTONIC timestamps.
+*/ ///////////////////////////////////////////
+
+static struct energy_sample ring[SAMPLER_RING_SIZE];
+static _Atomic unsigned long head = 0; // written by the sampler thread only
+static _Atomic unsigned long tail = 0; // written by the consumer only
+static atomic_int sampler_running = 0;
+static pthread_t sampler_thread;
+static long period_ns;
+
+// consumer side
+static struct energy_sample last; // newest sample at or before the last query
+static int have_last = 0;
+static unsigned long long window_start;
+static unsigned long long window_end;
+static long long peak_power; // in microwatts
+
+unsigned long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* sampler_thread_func() {
+    struct energy_sample sample;
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load_explicit(&sampler_running, memory_order_relaxed)) {
+        read_energy_snapshot(&sample.energy); // already free of wraps
+        sample.time = monotonic_ns();
+
+        unsigned long h = atomic_load_explicit(&head, memory_order_relaxed);
+        unsigned long t = atomic_load_explicit(&tail, memory_order_acquire);
+        if (h - t < SAMPLER_RING_SIZE) { // full, skip
+            ring[h & (SAMPLER_RING_SIZE - 1)] = sample;
+            atomic_store_explicit(&head, h + 1, memory_order_release);
+        }
+
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+    }
+    pthread_exit(NULL);
+}
+
+int start_energy_sampler(int period_ms) {
+    if (period_ms < SAMPLER_MIN_PERIOD || period_ms > SAMPLER_MAX_PERIOD) {
+        printf("Sampler period has to be %d-%d ms\n", SAMPLER_MIN_PERIOD, SAMPLER_MAX_PERIOD);
+        return -1;
+    }
+    period_ns = period_ms * 1000000L;
+    atomic_store(&sampler_running, 1);
+    if (pthread_create(&sampler_thread, NULL, sampler_thread_func, NULL) != 0) {
+        printf("Couldn't start energy sampler thread\n");
+        atomic_store(&sampler_running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void stop_energy_sampler() {
+    if (atomic_load(&sampler_running)) {
+        atomic_store(&sampler_running, 0);
+        pthread_join(sampler_thread, NULL);
+    }
+}
+
+// Power between two samples in microwatts, summed over packages
+static long long sample_power(struct energy_sample *a, struct energy_sample *b) {
+    long long energy = 0;
+    if (b->time <= a->time) {
+        return 0;
+    }
+    for (int i = 0; i < num_packages; i++) {
+        energy += (b->energy.pkg[i] - a->energy.pkg[i]) + (b->energy.dram[i] - a->energy.dram[i]);
+    }
+    return (long long) (energy * 1e9 / (b->time - a->time));
+}
+
+/* Energy counter totals at the given time, queries have to be in increasing order.
+   Waits for the first sample after time, returns -1 if the sampler stopped. */
+int sampler_energy_at(unsigned long long time, struct energy_snapshot *snapshot) {
+    struct energy_sample *next = NULL;
+    struct timespec wait = {0, period_ns / 2};
+
+    while (next == NULL) {
+        unsigned long t = atomic_load_explicit(&tail, memory_order_relaxed);
+        unsigned long h = atomic_load_explicit(&head, memory_order_acquire);
+        if (t == h) {
+            if (!atomic_load(&sampler_running)) {
+                break;
+            }
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        struct energy_sample *sample = &ring[t & (SAMPLER_RING_SIZE - 1)];
+        if (sample->time > time) {
+            next = sample; // keep it in the ring for the next query
+            break;
+        }
+        if (have_last) {
+            long long power = sample_power(&last, sample);
+            if (power > peak_power) {
+                peak_power = power;
+            }
+        }
+        last = *sample;
+        have_last = 1;
+        atomic_store_explicit(&tail, t + 1, memory_order_release);
+    }
+
+    if (next == NULL) {
+        if (!have_last) {
+            return -1;
+        }
+        *snapshot = last.energy;
+        return 0;
+    }
+    if (!have_last || time <= last.time) {
+        *snapshot = have_last ? last.energy : next->energy;
+        return 0;
+    }
+    // linear interpolation between the samples around time
+    double frac = (double) (time - last.time) / (next->time - last.time);
+    for (int i = 0; i < num_packages; i++) {
+        snapshot->pkg[i] = last.energy.pkg[i] + frac * (next->energy.pkg[i] - last.energy.pkg[i]);
+        snapshot->dram[i] = last.energy.dram[i] + frac * (next->energy.dram[i] - last.energy.dram[i]);
+    }
+    return 0;
+}
+
+/* Measurement windows, from the ring at exact CLOCK_MONOTONIC boundaries when
+   the sampler runs, otherwise plain reads around sleep() */
+void begin_energy_window(struct energy_snapshot *before) {
+    window_start = monotonic_ns();
+    window_end = 0;
+    peak_power = 0;
+    if (!atomic_load(&sampler_running) || sampler_energy_at(window_start, before) == -1) {
+        read_energy_snapshot(before);
+    }
+}
+
+void sleep_energy_window(int seconds) {
+    if (!atomic_load(&sampler_running)) {
+        sleep(seconds);
+        return;
+    }
+    window_end = window_start + seconds * 1000000000ULL;
+    struct timespec end = {window_end / 1000000000ULL, window_end % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL) == EINTR);
+}
+
+// Returns window length in seconds
+double end_energy_window(struct energy_snapshot *after) {
+    if (window_end == 0) {
+        window_end = monotonic_ns();
+    }
+    if (!atomic_load(&sampler_running) || sampler_energy_at(window_end, after) == -1) {
+        read_energy_snapshot(after);
+    }
+    return (window_end - window_start) * 1e-9;
+}
+
+// Highest power between two samples of the last window in microwatts, 0 without sampler
+long long energy_window_peak_power() {
+    return peak_power;
+}
@@ -0,0 +1,31 @@
+#ifndef energy_sampler_h
+#define energy_sampler_h
+
+#include "energy.h"
+
+#define SAMPLER_RING_SIZE 8192 // power of two
+#define SAMPLER_MIN_PERIOD 1 // in milliseconds
+#define SAMPLER_MAX_PERIOD 10 // in milliseconds
+
+struct energy_sample {
+    unsigned long long time; // CLOCK_MONOTONIC in nanoseconds
+    struct energy_snapshot energy; // totals of read_energy_snapshot, wraps already fixed
+};
+
+unsigned long long monotonic_ns();
+
+int start_energy_sampler(int period_ms);
+
+void stop_energy_sampler();
+
+int sampler_energy_at(unsigned long long time, struct energy_snapshot *snapshot);
+
+void begin_energy_window(struct energy_snapshot *before);
+
+void sleep_energy_window(int seconds);
+
+double end_energy_window(struct energy_snapshot *after);
+
+long long energy_window_peak_power();
+
+#endif
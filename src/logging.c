@@ -3,7 +3,9 @@
 #include <string.h>
 #include "process_stats.h"
 #include "container_stats.h"
+#include "cgroup_tree.h"
 #include "benchmarking.h"
+#include "perf_sampling.h"
 
 FILE* initLogFile() {
     time_t rawtime;
@@ -60,28 +62,75 @@ int writeToFile(FILE *fp, char* buffer) {
 
 int system_stats_to_buffer(struct system_stats *s_stats, long long energy, char* buffer) {
     char toString[256];
-    // energy_rapl_total, cputime_jiffies, ram_kB, io_op, cycles
-    sprintf(toString, "%lld;%lu;%ld;%ld;%lld\n", energy, s_stats->cputime, s_stats->rss, 
-            s_stats->io_op, s_stats->cycles);
+    // energy_rapl_total, cputime_jiffies, ram_kB, io_op, cycles, multiplex_ratio
+    sprintf(toString, "%lld;%lu;%ld;%ld;%lld;%.3f\n", energy, s_stats->cputime, s_stats->rss, 
+            s_stats->io_op, s_stats->cycles, s_stats->multiplex_ratio);
     sprintf(buffer + strlen(buffer), "%s", toString);
     return 0;
 }
 
 int process_stats_to_buffer(struct proc_stats *p_stats, char* buffer) {
     char toString[256];
-    // pid, cputime_jiffies, ram_kB, io_op, cycles, estimated energy
-    sprintf(toString, "%d;%lu;%ld;%ld;%lld;%lld\n", p_stats->pid, p_stats->cputime,
-            p_stats->rss, p_stats->io_op, p_stats->cycles_interval, p_stats->energy_interval_est);
+    // pid, cputime_jiffies, ram_kB, io_op, cycles, estimated energy, multiplex_ratio, parent, lifetime energy,
+    // llc_misses, estimated DRAM energy
+    sprintf(toString, "%d;%lu;%ld;%ld;%lld;%lld;%.3f;%d;%lld;%lld;%lld\n", p_stats->pid, p_stats->cputime,
+            p_stats->rss, p_stats->io_op, p_stats->cycles_interval, p_stats->energy_interval_est,
+            p_stats->multiplex_ratio, p_stats->parent, p_stats->energy_total_est, p_stats->llc_misses_interval,
+            p_stats->energy_dram_interval_est);
 
     strcat(buffer, toString);
     return 0;
 }
 
 int container_stats_to_buffer(struct container_stats *c_stats, char* buffer) {
-    char toString[370];
-    // id, cputime_us, ram_bytes, io_op, cycles, estimated energy
-    sprintf(toString, "%s;%llu;%lld;%lu;%llu;%lld\n", c_stats->id, c_stats->cputime,
-            c_stats->memory, c_stats->io_op, c_stats->cycles_interval, c_stats->energy_interval_est);
+    char toString[768];
+    struct cgroup_counters *interval = &c_stats->counters_interval;
+    // id, cputime_us, ram_bytes, io_op, cycles, estimated energy, llc_misses, estimated DRAM energy,
+    // user_us, system_us, nr_throttled, throttled_us, anon_bytes, file_bytes, kernel_bytes,
+    // stall_us cpu some/full, io some/full, memory some/full (interval values except memory),
+    // counters state (0 pending, 1 partial interval, 2 live; energy only attributed when live)
+    sprintf(toString, "%s;%llu;%lld;%lu;%llu;%lld;%lld;%lld;%llu;%llu;%llu;%llu;%lld;%lld;%lld;"
+            "%llu;%llu;%llu;%llu;%llu;%llu;%d\n", c_stats->id, c_stats->cputime,
+            c_stats->memory, c_stats->io_op, c_stats->cycles_interval, c_stats->energy_interval_est,
+            c_stats->llc_misses_interval, c_stats->energy_dram_interval_est, interval->user_usec,
+            interval->system_usec, interval->nr_throttled, interval->throttled_usec, interval->anon,
+            interval->file, interval->kernel, interval->cpu_some, interval->cpu_full, interval->io_some,
+            interval->io_full, interval->memory_some, interval->memory_full, c_stats->counters_state);
+
+    strcat(buffer, toString);
+    return 0;
+}
+
+int cgroup_node_to_buffer(struct cgroup_node *node, char* buffer) {
+    char toString[CGROUP_PATH + 256];
+    // path, depth, leaf, own cputime_us, own ram_bytes, own io_op, cycles, llc_misses, estimated energy,
+    // estimated DRAM energy, estimated subtree energy, throttled_us, stall_us (some) cpu, io, memory
+    sprintf(toString, "/%s;%d;%d;%ld;%lld;%ld;%lld;%lld;%lld;%lld;%lld;%llu;%llu;%llu;%llu\n", node->path,
+            node->depth, node->leaf, node->own_cputime_interval, node->own_memory, node->own_io_op_interval,
+            node->cycles_interval, node->llc_misses_interval, node->energy_interval_est,
+            node->energy_dram_interval_est, node->energy_subtree_est, node->counters_interval.throttled_usec,
+            node->counters_interval.cpu_some, node->counters_interval.io_some,
+            node->counters_interval.memory_some);
+
+    strcat(buffer, toString);
+    return 0;
+}
+
+int thread_stats_to_buffer(pid_t pid, struct thread_stats *t_stats, char* buffer) {
+    char toString[160];
+    // pid, tid, name, runtime_ns, cycles, estimated energy
+    sprintf(toString, "%d;%d;%s;%llu;%lld;%lld\n", pid, t_stats->tid, t_stats->comm,
+            t_stats->runtime_interval, t_stats->cycles_interval, t_stats->energy_interval_est);
+
+    strcat(buffer, toString);
+    return 0;
+}
+
+int sampled_process_to_buffer(struct sampled_process *s_process, char* buffer) {
+    char toString[128];
+    // pid, sampled cycles, estimated energy, estimated DRAM energy
+    sprintf(toString, "%d;%lld;%lld;%lld\n", s_process->pid, s_process->cycles, s_process->energy_interval_est,
+            s_process->energy_dram_interval_est);
 
     strcat(buffer, toString);
     return 0;
@@ -98,27 +147,29 @@ int e_stats_to_buffer(double cpu_time, long max_rss, long io, long long cycles,
 
 int system_interval_to_buffer(struct system_stats *s_stats, long long energy, char* buffer) {
     char toString[256];
-    // energy_total_rapl_uj, cputime_jiffies, ram_kB, io_op, cycles
-    sprintf(toString, "%lld;%lu;%ld;%ld;%lld\n", energy, s_stats->cputime_interval, s_stats->rss_interval, 
-            s_stats->io_op_interval, s_stats->cycles);
+    // energy_total_rapl_uj, cputime_jiffies, ram_kB, io_op, cycles, multiplex_ratio
+    sprintf(toString, "%lld;%lu;%ld;%ld;%lld;%.3f\n", energy, s_stats->cputime_interval, s_stats->rss_interval, 
+            s_stats->io_op_interval, s_stats->cycles, s_stats->multiplex_ratio);
     strcat(buffer, toString);
     return 0;
 }
 
 int system_interval_gpu_to_buffer(struct system_stats *s_stats, long long energy, long long gpu_energy, char* buffer) {
     char toString[256];
-    // energy_total_rapl_uj, gpu_energy, cputime_jiffies, ram_kB, io_op, cycles
-    sprintf(toString, "%lld;%lld;%lu;%ld;%ld;%lld\n", energy, gpu_energy, s_stats->cputime_interval, s_stats->rss_interval, 
-            s_stats->io_op_interval, s_stats->cycles);
+    // energy_total_rapl_uj, gpu_energy, cputime_jiffies, ram_kB, io_op, cycles, multiplex_ratio
+    sprintf(toString, "%lld;%lld;%lu;%ld;%ld;%lld;%.3f\n", energy, gpu_energy, s_stats->cputime_interval, s_stats->rss_interval, 
+            s_stats->io_op_interval, s_stats->cycles, s_stats->multiplex_ratio);
     strcat(buffer, toString);
     return 0;
 }
 
 int cgroup_stats_to_buffer(struct cgroup_stats *c_stats, double time, char* buffer) {
     char toString[512];
-    // time, cputime_us, max_ram_bytes, io_op, r_bytes, w_bytes cycles, estimated_energy_uj
-    sprintf(toString, "%f;%llu;%lld;%lu;%llu;%llu;%llu;%lld\n", time, c_stats->cputime, c_stats->maxRSS,
-            c_stats->io_op, c_stats->r_bytes, c_stats->w_bytes ,c_stats->cycles, c_stats->estimated_energy);
+    // time, cputime_us, max_ram_bytes, io_op, r_bytes, w_bytes cycles, estimated_energy_uj, llc_misses,
+    // estimated_dram_energy_uj
+    sprintf(toString, "%f;%llu;%lld;%lu;%llu;%llu;%llu;%lld;%lld;%lld\n", time, c_stats->cputime, c_stats->maxRSS,
+            c_stats->io_op, c_stats->r_bytes, c_stats->w_bytes ,c_stats->cycles, c_stats->estimated_energy,
+            c_stats->llc_misses, c_stats->estimated_dram_energy);
 
     strcat(buffer, toString);
     return 0;
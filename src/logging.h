@@ -13,6 +13,12 @@ int process_stats_to_buffer(struct proc_stats *proc_stats, char* buffer);
 
 int container_stats_to_buffer(struct container_stats *container_stats, char* buffer);
 
+int cgroup_node_to_buffer(struct cgroup_node *node, char* buffer);
+
+int thread_stats_to_buffer(pid_t pid, struct thread_stats *t_stats, char* buffer);
+
+int sampled_process_to_buffer(struct sampled_process *s_process, char* buffer);
+
 int e_stats_to_buffer(double cpu_time, long max_rss, long io, long long cycles, long long energy, char* buffer);
 
 int system_interval_to_buffer(struct system_stats *s_stats, long long energy, char* buffer);
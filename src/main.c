@@ -11,84 +11,217 @@
 #include <dirent.h>
 #include "energy.h"
 #include "process_stats.h"
+#include "process_table.h"
 #include "perf_events.h"
 #include "container_stats.h"
+#include "cgroup_tree.h"
+#include "perf_sampling.h"
+#include "proc_events.h"
+#include "taskstats.h"
 #include "logging.h"
 #include "benchmarking.h"
+#include "energy_sampler.h"
+#include "energy_model.h"
 // #include "read_nvidia_gpu.h"
 
 #define MAX_CPUS sysconf(_SC_NPROCESSORS_CONF)
 #define CLK_TCK sysconf(_SC_CLK_TCK)
 #define interval 1 // measurements taken in intervals (in seconds) for system-wide, -m and -c
+#define top_processes 10 // printed per interval in -p and without arguments, all are logged
+#define top_threads_printed 5 // printed per process in -m with -t, all are logged
 
 static void print_pinfo(struct proc_stats *p_info);
+static long process_memory(struct proc_stats *p_stats, int use_pss);
+static long long estimate_dram(struct system_stats *s_stats, long long llc_misses, long long cycles,
+        long long memory, long long dram_energy, double time);
+static void print_thread_breakdown(struct proc_stats *p_info);
+static int add_process(struct process_table *table, pid_t pid, pid_t parent, int thread_breakdown);
+static void final_process_counters(struct process_table *table, struct proc_stats *p_stats);
+static void handle_proc_events(struct proc_event_info *events, int num_events, struct process_table *table,
+        int thread_breakdown);
+static void handle_host_events(struct proc_event_info *events, int num_events, struct process_table *table);
+static void update_host_processes(struct process_table *table, int *stats_ret);
 static void print_system_stats(struct system_stats *system_info);
 static void print_container_info(struct container_stats *container);
+static void print_cgroup_node(struct cgroup_node *node);
+static void print_sampled_process(struct sampled_process *process);
+static int compare_sampled_processes(const void *a, const void *b);
 static void print_cgroup_stats(struct cgroup_stats *cg);
 static void print_help();
+static void remove_args(int *argc, char *argv[], int n);
+static long long read_cpu_counters(int *fds_cpu, struct system_stats *s_stats, long long *cycles_package);
+static void system_model_counters(struct system_stats *s_stats, struct model_counters *counters);
+static void process_model_counters(struct proc_stats *p_stats, struct model_counters *counters);
+static void container_model_counters(struct container_stats *c_stats, struct model_counters *counters);
+static void cgroup_node_model_counters(struct cgroup_node *node, struct model_counters *counters);
+static void cgroup_model_counters(struct cgroup_stats *cg_stats, struct model_counters *counters);
 
 
 int main(int argc, char *argv[]) {
-    pid_t pid;
     int status, ret, fd;
     struct rusage usage;
-    long long energy_before_pkg = 0; // microjoules
-    long long energy_before_dram = 0; // microjoules
-    long long energy_after_pkg = 0; // microjoules
-    long long energy_after_dram = 0; // microjoules
+    struct energy_snapshot energy_before = {0}; // microjoules
+    struct energy_snapshot energy_after = {0}; // microjoules
+    long long energy_package[RAPL_MAX_PACKAGES] = {0}; // microjoules
+    long long cycles_package[RAPL_MAX_PACKAGES] = {0};
+    struct model_counters system_counters; // attribution model input
+    struct model_counters entity_counters;
     long long total_energy_used = 0; // microjoules
+    long long dram_energy_used = 0; // microjoules, part of total_energy_used
+    long long package_energy_used = 0; // microjoules, total_energy_used without DRAM
     struct system_stats system_stats = {0};
     int fds_cpu[MAX_CPUS];
     long long cpu_cycles = 0;
     int logging_enabled = 0; // Flag to indicate if logging is enabled
+    int sampler_period = 0; // in milliseconds, 0 -> no sampler thread
+    int thread_breakdown = 0; // -m also reports per thread
+    int dram_pss = 0; // DRAM idle energy of processes by PSS instead of RSS
+    int use_taskstats = 0; // process cpu time over netlink instead of /proc/pid/stat
     char logging_buffer[4096] = "";
     FILE *logfile;
     
-    init_rapl();
-
-    // Check if the first argument is '-l' and set logging flag
-    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
-        logging_enabled = 1;
-        // Remove '-l' from the argument list
-        for (int i = 1; i < argc - 1; i++) {
-            argv[i] = argv[i + 1];
+    // Global options before the mode: -l logging, -s energy sampler period in ms, -r energy source,
+    // -M attribution model, -u user-space counter reads, -t per-thread breakdown in -m,
+    // -d DRAM idle energy by PSS, -n process cpu time from taskstats
+    while (argc > 1) {
+        if (strcmp(argv[1], "-l") == 0) {
+            logging_enabled = 1;
+            remove_args(&argc, argv, 1);
+            logfile = initLogFile();
+        } else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+            sampler_period = atoi(argv[2]);
+            remove_args(&argc, argv, 2);
+        } else if (strcmp(argv[1], "-M") == 0 && argc > 2) {
+            if (set_energy_model(argv[2]) == -1) {
+                return -1;
+            }
+            remove_args(&argc, argv, 2);
+        } else if (strcmp(argv[1], "-t") == 0) {
+            thread_breakdown = 1;
+            remove_args(&argc, argv, 1);
+        } else if (strcmp(argv[1], "-d") == 0) {
+            dram_pss = 1;
+            remove_args(&argc, argv, 1);
+        } else if (strcmp(argv[1], "-n") == 0) {
+            use_taskstats = 1;
+            remove_args(&argc, argv, 1);
+        } else if (strcmp(argv[1], "-u") == 0) {
+            setCounterMmap(1);
+            remove_args(&argc, argv, 1);
+        } else if (strcmp(argv[1], "-r") == 0 && argc > 2) {
+            if (set_energy_source(argv[2]) == -1) {
+                return -1;
+            }
+            remove_args(&argc, argv, 2);
+        } else {
+            break;
         }
-        argc--;
-        logfile = initLogFile();
+    }
+    init_rapl();
+    if (sampler_period > 0 && start_energy_sampler(sampler_period) == -1) {
+        return -1;
     }
 
     // No arguments provided, system-wide monitoring
     if (argc < 2) 
     {
-        // Set up system-wide cycles
+        struct process_table *table = init_process_table(); // every process of the host
+        struct proc_event_info events[PROC_EVENTS_MAX];
+        int fds_sampling[MAX_CPUS];
+        int top[top_processes];
+        int *stats_ret = NULL;
+        if (table == NULL) {
+            return -1;
+        }
+        // Processes come and go with fork/exit notifications, otherwise /proc is scanned every interval
+        int proc_events_enabled = init_proc_events() == 0;
+        if (use_taskstats) {
+            init_taskstats();
+        }
+        scan_process_table(table);
+        stats_ret = realloc(stats_ret, sizeof(int) * table->num);
+        read_process_stats_batch(table->entries, table->num, stats_ret); // start values of the first interval
+
+        // Set up system-wide cycles, per-process cycles from one sampling event per cpu
         for (int i = 0; i < MAX_CPUS; i++) {
-            fds_cpu[i] = setUpProcCycles_cpu(i);
+            fds_cpu[i] = setUpCpuGroup(i);
+            fds_sampling[i] = setUpCpuSampling(i, 0);
         }
         while (1)
         {
             cpu_cycles = 0;
-            energy_before_pkg = read_energy(0);
-            energy_before_dram = read_energy(3);
+            begin_energy_window(&energy_before);
             ret = read_systemwide_stats(&system_stats);
 
-            sleep(interval);
-
-            for (int i = 0; i < MAX_CPUS; i++) {   
-                cpu_cycles += readInterval(fds_cpu[i]);
+            if (proc_events_enabled) {
+                unsigned long long deadline = monotonic_ns() + interval * 1000000000ULL;
+                unsigned long long now;
+                while ((now = monotonic_ns()) < deadline) {
+                    int num_events = wait_proc_events((deadline - now + 999999) / 1000000, events,
+                        PROC_EVENTS_MAX);
+                    handle_host_events(events, num_events, table);
+                }
+            } else {
+                sleep_energy_window(interval);
+                scan_process_table(table);
             }
+
+            cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
             system_stats.cycles = cpu_cycles;
-            energy_after_pkg = read_energy(0);
-            energy_after_dram = read_energy(3);
+            system_stats.multiplex_ratio = multiplexRatio();
+            end_energy_window(&energy_after);
             ret = read_systemwide_stats(&system_stats);
-            total_energy_used = check_overflow(energy_before_dram, energy_after_dram) 
-                                + check_overflow(energy_before_pkg, energy_after_pkg);
+            total_energy_used = energy_interval_total(&energy_before, &energy_after);
+            dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+            package_energy_used = total_energy_used - dram_energy_used;
+            system_model_counters(&system_stats, &system_counters);
+            update_energy_model(&system_counters, package_energy_used, interval);
+
+            // Per-process statistics, cycles from the samples of the interval
+            stats_ret = realloc(stats_ret, sizeof(int) * table->num);
+            for (int i = 0; i < MAX_CPUS; i++) {
+                readSamples(fds_sampling[i]);
+            }
+            update_host_processes(table, stats_ret);
+            clearSamples();
+            for (int i = 0; i < table->num; i++)
+            {
+                process_model_counters(&table->entries[i], &entity_counters);
+                table->entries[i].energy_interval_est = estimate_energy_model(&system_counters, &entity_counters,
+                                                package_energy_used, interval);
+                // DRAM by sampled cycles, no per-process LLC counters for the whole host
+                table->entries[i].energy_dram_interval_est = estimate_dram(&system_stats, -1,
+                    table->entries[i].cycles_interval, process_memory(&table->entries[i], dram_pss),
+                    dram_energy_used, interval);
+                table->entries[i].energy_total_est += table->entries[i].energy_interval_est
+                    + table->entries[i].energy_dram_interval_est;
+            }
             print_system_stats(&system_stats);
-            printf("Interval(%d): total energy (microjoules): %lld, CPU-cycles: %lld\n", 
-                interval, total_energy_used, system_stats.cycles);
+            int found = top_process_entries(table, top, top_processes);
+            for (int i = 0; i < found; i++) {
+                print_pinfo(&table->entries[top[i]]);
+            }
+            printf("Interval(%d): total energy (microjoules): %lld, CPU-cycles: %lld, processes: %d\n", 
+                interval, total_energy_used, system_stats.cycles, table->num);
             if(logging_enabled == 1) {
+                // Logging, flushed in chunks since there can be thousands of processes
                 system_stats_to_buffer(&system_stats, total_energy_used, logging_buffer);
+                for (int i = 0; i < table->num; i++)
+                {
+                    process_stats_to_buffer(&table->entries[i], logging_buffer);
+                    if (strlen(logging_buffer) > sizeof(logging_buffer) - 256) {
+                        writeToFile(logfile, logging_buffer);
+                    }
+                }
                 writeToFile(logfile, logging_buffer);
             }
+            // Remove ended processes
+            for (int i = 0; i < table->num; i++) {
+                if (table->entries[i].exited) {
+                    remove_process_entry(table, &table->entries[i]);
+                    i--; // last entry moved here
+                }
+            }
         }
         
         return 0;
@@ -119,33 +252,50 @@ int main(int argc, char *argv[]) {
         ret = read_systemwide_stats(&system_stats);
         cpu_cycles = 0;
         for (int i = 0; i < MAX_CPUS; i++) {
-            fds_cpu[i] = setUpProcCycles_cpu(i);
+            fds_cpu[i] = setUpCpuGroup(i);
         }
         gettimeofday(&start, NULL);
-        energy_before_pkg = read_energy(0);
-        energy_before_dram = read_energy(3);
+        begin_energy_window(&energy_before);
 
         // Run the command
         system(command);
 
         // Measurements
-        energy_after_pkg = read_energy(0);
-        energy_after_dram = read_energy(3);
+        end_energy_window(&energy_after);
         gettimeofday(&end, NULL);
-        for (int i = 0; i < MAX_CPUS; i++) {   
-            cpu_cycles += readInterval(fds_cpu[i]);
-            closeEvent(fds_cpu[i]);
+        cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
+        for (int i = 0; i < MAX_CPUS; i++) {
+            closeGroup(fds_cpu[i]);
         }
         ret = read_systemwide_stats(&system_stats);
         read_cgroup_stats(&cg_stats);
         system_stats.cycles = cpu_cycles;
-        total_energy_used = check_overflow(energy_before_dram, energy_after_dram) 
-                            + check_overflow(energy_before_pkg, energy_after_pkg);
+        system_stats.multiplex_ratio = multiplexRatio();
+        total_energy_used = energy_interval_total(&energy_before, &energy_after);
+        dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+        package_energy_used = total_energy_used - dram_energy_used;
         elapsedTime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6;
-        cg_stats.estimated_energy = estimate_energy_cycles(system_stats.cycles, cg_stats.cycles, total_energy_used, elapsedTime);
+        for (int i = 0; i < num_packages; i++) {
+            energy_package[i] = energy_interval_package(&energy_before, &energy_after, i);
+        }
+        system_model_counters(&system_stats, &system_counters);
+        update_energy_model(&system_counters, package_energy_used, elapsedTime);
+        if (energy_model_is_baseline()) {
+            cg_stats.estimated_energy = estimate_energy_cycles_packages(cycles_package, cg_stats.cycles_package,
+                    energy_package, elapsedTime);
+        } else {
+            cgroup_model_counters(&cg_stats, &entity_counters);
+            cg_stats.estimated_energy = estimate_energy_model(&system_counters, &entity_counters,
+                    package_energy_used, elapsedTime);
+        }
+        cg_stats.estimated_dram_energy = estimate_dram(&system_stats, cg_stats.llc_misses, cg_stats.cycles,
+                cg_stats.maxRSS / 1024, dram_energy_used, elapsedTime);
         print_cgroup_stats(&cg_stats);
         printf("Total energy in microjoules: %lld\n", total_energy_used);
         printf("Elapsed time: %f\n", elapsedTime);
+        if (sampler_period > 0) {
+            printf("Peak power in microwatts: %lld\n", energy_window_peak_power());
+        }
         if (logging_enabled == 1) {
             system_interval_to_buffer(&system_stats, total_energy_used, logging_buffer);
             cgroup_stats_to_buffer(&cg_stats, elapsedTime, logging_buffer);
@@ -153,6 +303,7 @@ int main(int argc, char *argv[]) {
             fclose(logfile);
         }
 
+        stop_energy_sampler();
         close_cgroup();
         return 0;
     }
@@ -160,118 +311,199 @@ int main(int argc, char *argv[]) {
     // -m (monitor given processes given by their id, e.g. -m 1 2 3)
     else if (strcmp(argv[1], "-m") == 0)
     {
-        int num_processes = argc - 2;
-        struct proc_stats *processes = malloc(num_processes * sizeof(struct proc_stats)); // allocate memory
+        struct process_table *table = init_process_table(); // keyed by pid and start time
+        if (table == NULL) {
+            return -1;
+        }
+        struct proc_event_info events[PROC_EVENTS_MAX];
+        int num_exited = 0; // processes that ended while monitored
+        long long exited_energy = 0; // their lifetime energy in microjoules
+        // Fork/exec/exit notifications, without them an exit is noticed once /proc is gone
+        int proc_events_enabled = init_proc_events() == 0;
+        // Per-process stats from /proc, with -n batched over netlink when taskstats is available
+        if (use_taskstats) {
+            init_taskstats();
+        }
+        int *stats_ret = NULL;
         // Create proc_stats for each process id
-        for (int i = 0; i < num_processes; i++)
+        for (int i = 2; i < argc; i++)
         { 
-            pid = (pid_t) atoi(argv[i+2]);
-            int proc_fd = setUpProcCycles(pid);
-            processes[i].pid = pid;
-            processes[i].cputime = 0;
-            processes[i].rss = 0;
-            processes[i].io_op = 0;
-            processes[i].cputime_interval = 0;
-            processes[i].rss_interval = 0;
-            processes[i].io_op_interval = 0;
-            processes[i].fd = proc_fd;
-            processes[i].energy_interval_est = 0;
-            ret = read_process_stats(&processes[i]);
+            add_process(table, (pid_t) atoi(argv[i]), 0, thread_breakdown);
         }
         ret = read_systemwide_stats(&system_stats);
         // Set up system-wide cycles
         for (int i = 0; i < MAX_CPUS; i++)
         {
-            fds_cpu[i] = setUpProcCycles_cpu(i);
+            fds_cpu[i] = setUpCpuGroup(i);
         }
-        while (num_processes > 0) 
+        while (table->num > 0) 
         {
-            energy_before_pkg = read_energy(0);
-            energy_before_dram = read_energy(3);
+            begin_energy_window(&energy_before);
             cpu_cycles = 0;
 
-            sleep(interval);
+            if (proc_events_enabled) {
+                // Same window length, woken up for forks and exits of monitored processes
+                unsigned long long deadline = monotonic_ns() + interval * 1000000000ULL;
+                unsigned long long now;
+                while ((now = monotonic_ns()) < deadline) {
+                    int num_events = wait_proc_events((deadline - now + 999999) / 1000000, events,
+                        PROC_EVENTS_MAX);
+                    handle_proc_events(events, num_events, table, thread_breakdown);
+                }
+            } else {
+                sleep_energy_window(interval);
+            }
 
-            energy_after_pkg = read_energy(0);
-            energy_after_dram = read_energy(3);
+            end_energy_window(&energy_after);
             read_systemwide_stats(&system_stats);
-            total_energy_used = check_overflow(energy_before_pkg, energy_after_pkg)
-                                + check_overflow(energy_before_dram, energy_after_dram);
+            total_energy_used = energy_interval_total(&energy_before, &energy_after);
+            dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+            package_energy_used = total_energy_used - dram_energy_used;
             
-            for (int i = 0; i < MAX_CPUS; i++)
-            {   
-                cpu_cycles += readInterval(fds_cpu[i]);
-            }
+            cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
             system_stats.cycles = cpu_cycles;
+            system_model_counters(&system_stats, &system_counters);
+            update_energy_model(&system_counters, package_energy_used, interval);
             // Update/remove ended processes
-            for (int i = 0; i < num_processes; i++)
+            stats_ret = realloc(stats_ret, sizeof(int) * table->num);
+            read_process_stats_batch(table->entries, table->num, stats_ret);
+            for (int i = 0; i < table->num; i++)
             {
-                ret = read_process_stats(&processes[i]);
-                processes[i].cycles_interval = readInterval(processes[i].fd);
-                if (ret == -1) 
-                {
-                    // Process has terminated, remove it from the array
-                    closeEvent(processes[i].fd);
-                    if (num_processes==1) { // all processes terminated
-                        return 0;
-                    }
-                    for (int j = i; j < num_processes - 1; j++) {
-                        processes[j] = processes[j + 1];
+                struct proc_stats *p_stats = &table->entries[i];
+                // Processes that ended in the window already have their final counters
+                if (!p_stats->exited) {
+                    if (stats_ret[i] == -1) {
+                        final_process_counters(table, p_stats); // ended without notification
+                    } else {
+                        p_stats->cycles_interval = readInterval(p_stats->fd)
+                            + read_thread_counters(p_stats->thread_fds, p_stats->num_thread_fds);
+                        p_stats->multiplex_ratio = runningRatio(p_stats->fd);
+                        if (p_stats->llc_fd != -1) {
+                            p_stats->llc_misses_interval = readInterval(p_stats->llc_fd);
+                        }
                     }
-                    num_processes--;
-                    i--; // correct current index
                 }
 
-                // Estimate energy
-                processes[i].energy_interval_est = estimate_energy_cycles(system_stats.cycles,
-                                                processes[i].cycles_interval, total_energy_used, interval);
-                print_pinfo(&processes[i]);
+                // Estimate energy, a followed child's share is billed to the process counting it
+                if (p_stats->parent != 0) {
+                    p_stats->energy_interval_est = 0;
+                    p_stats->energy_dram_interval_est = 0;
+                } else {
+                    process_model_counters(p_stats, &entity_counters);
+                    p_stats->energy_interval_est = estimate_energy_model(&system_counters, &entity_counters,
+                                                    package_energy_used, interval);
+                    p_stats->energy_dram_interval_est = estimate_dram(&system_stats,
+                        p_stats->llc_misses_interval, p_stats->cycles_interval,
+                        process_memory(p_stats, dram_pss), dram_energy_used, interval);
+                }
+                p_stats->energy_total_est += p_stats->energy_interval_est + p_stats->energy_dram_interval_est;
+                print_pinfo(p_stats);
+                if (p_stats->threads != NULL) {
+                    read_thread_stats(p_stats->pid, p_stats->threads);
+                    split_process_counters(p_stats->threads, p_stats->cycles_interval,
+                        p_stats->energy_interval_est);
+                    print_thread_breakdown(p_stats);
+                }
             }
+            system_stats.multiplex_ratio = multiplexRatio();
             printf("Interval(%d): total energy (microjoules): %lld, CPU-cycles: %lld\n", 
                 interval, total_energy_used, system_stats.cycles);
             if (logging_enabled == 1) {
                 // Logging
                 system_stats_to_buffer(&system_stats, total_energy_used, logging_buffer);
-                for (int i = 0; i < num_processes; i++)
+                for (int i = 0; i < table->num; i++)
                 {
-                    process_stats_to_buffer(&processes[i], logging_buffer);
+                    process_stats_to_buffer(&table->entries[i], logging_buffer);
+                    struct thread_table *threads = table->entries[i].threads;
+                    for (int j = 0; threads != NULL && j < threads->num_current; j++) {
+                        thread_stats_to_buffer(table->entries[i].pid, &threads->current[j], logging_buffer);
+                        if (strlen(logging_buffer) > sizeof(logging_buffer) - 256) {
+                            writeToFile(logfile, logging_buffer);
+                        }
+                    }
                 }
                 writeToFile(logfile, logging_buffer);
             }
+            // Remove ended processes, their lifetime energy is kept
+            for (int i = 0; i < table->num; i++)
+            {
+                if (table->entries[i].exited) {
+                    printf("Process %d ended, lifetime estimated energy in microjoules: %lld\n",
+                        table->entries[i].pid, table->entries[i].energy_total_est);
+                    num_exited++;
+                    exited_energy += table->entries[i].energy_total_est;
+                    remove_process_entry(table, &table->entries[i]);
+                    i--; // last entry moved here
+                }
+            }
+            if (num_exited > 0) {
+                printf("Ended processes: %d, lifetime estimated energy in microjoules: %lld\n",
+                    num_exited, exited_energy);
+            }
         }
-        free(processes);
+        close_proc_events();
+        close_taskstats();
+        free(stats_ret);
+        free_process_table(table);
     }
 
     // -c (monitor running docker containers) 
     else if (strcmp(argv[1], "-c") == 0)
     {
-        init_docker_container();
+        // -c sampling: per-cpu cycles sampling by cgroup id instead of cgroup counters
+        if (argc > 2 && strcmp(argv[2], "sampling") == 0) {
+            ret = init_docker_container_sampling();
+        } else {
+            ret = init_docker_container();
+        }
+        if (ret == -1) {
+            return -1;
+        }
         // Set up system-wide cycles
         for (int i = 0; i < MAX_CPUS; i++) {
-            fds_cpu[i] = setUpProcCycles_cpu(i);
+            fds_cpu[i] = setUpCpuGroup(i);
         }
         get_docker_containers();
         while(1) {
             cpu_cycles = 0;
-            energy_before_pkg = read_energy(0);
-            energy_before_dram = read_energy(3);
-            sleep(interval);
-            energy_after_pkg = read_energy(0);
-            energy_after_dram = read_energy(3);
+            begin_energy_window(&energy_before);
+            sleep_energy_window(interval);
+            end_energy_window(&energy_after);
             ret = read_systemwide_stats(&system_stats);
-            total_energy_used = check_overflow(energy_before_dram, energy_after_dram) 
-                                + check_overflow(energy_before_pkg, energy_after_pkg);
+            total_energy_used = energy_interval_total(&energy_before, &energy_after);
+            dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+            package_energy_used = total_energy_used - dram_energy_used;
             // Update containers
             update_docker_containers();
-            for (int i = 0; i < MAX_CPUS; i++) {   
-                cpu_cycles += readInterval(fds_cpu[i]);
-            }
+            cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
             system_stats.cycles = cpu_cycles;
-            // Estimate energy
+            system_stats.multiplex_ratio = multiplexRatio();
+            for (int i = 0; i < num_packages; i++) {
+                energy_package[i] = energy_interval_package(&energy_before, &energy_after, i);
+            }
+            system_model_counters(&system_stats, &system_counters);
+            update_energy_model(&system_counters, package_energy_used, interval);
+            // Estimate energy, cycles only model per socket the container's cycles ran on
             for (int i = 0; i < num_containers; i++)
             {
-                containers[i].energy_interval_est = estimate_energy_cycles(cpu_cycles,
-                    containers[i].cycles_interval, total_energy_used, interval);
+                // Cycles of a container whose counters went live meanwhile cover only part of the interval
+                if (containers[i].counters_state != CONTAINER_LIVE) {
+                    containers[i].energy_interval_est = 0;
+                    containers[i].energy_dram_interval_est = 0;
+                    print_container_info(&containers[i]);
+                    continue;
+                }
+                if (energy_model_is_baseline()) {
+                    containers[i].energy_interval_est = estimate_energy_cycles_packages(cycles_package,
+                        containers[i].cycles_package, energy_package, interval);
+                } else {
+                    container_model_counters(&containers[i], &entity_counters);
+                    containers[i].energy_interval_est = estimate_energy_model(&system_counters,
+                        &entity_counters, package_energy_used, interval);
+                }
+                containers[i].energy_dram_interval_est = estimate_dram(&system_stats,
+                    containers[i].llc_misses_interval, containers[i].cycles_interval,
+                    containers[i].memory / 1024, dram_energy_used, interval);
                 print_container_info(&containers[i]);
             }
             printf("Interval(%d): total energy (microjoules): %lld, CPU-cycles: %lld\n", 
@@ -282,48 +514,169 @@ int main(int argc, char *argv[]) {
                 for (int i = 0; i < num_containers; i++)
                 {
                     container_stats_to_buffer(&containers[i], logging_buffer);
+                    if (strlen(logging_buffer) > sizeof(logging_buffer) - 1024) {
+                        writeToFile(logfile, logging_buffer);
+                    }
                 }
                 writeToFile(logfile, logging_buffer);
             }
         }
     }
 
-    // -i (calibration, execute on idle system for idle energy per second)
-    else if (strcmp(argv[1], "-i") == 0) 
+    // -g (any cgroup v2 subtree down to a depth, e.g. -g kubepods.slice 2)
+    else if (strcmp(argv[1], "-g") == 0 && argc > 2)
     {
-        int measurements = 181;
-        long long measured_values[measurements];
+        char root[CGROUP_PATH];
+        // Relative to the cgroup v2 mount unless absolute, depth 1 by default
+        snprintf(root, sizeof(root), argv[2][0] == '/' ? "%s" : "/sys/fs/cgroup/%s", argv[2]);
+        struct cgroup_tree *tree = init_cgroup_tree(root, argc > 3 ? atoi(argv[3]) : 1);
+        if (tree == NULL) {
+            return -1;
+        }
 
-        for (int i = 0; i < measurements; i++)
-        {
-            measured_values[i] = read_energy(0) + read_energy(3);
-            sleep(1);
+        // Set up system-wide cycles
+        for (int i = 0; i < MAX_CPUS; i++) {
+            fds_cpu[i] = setUpCpuGroup(i);
         }
+        while(1) {
+            begin_energy_window(&energy_before);
+            sleep_energy_window(interval);
+            end_energy_window(&energy_after);
+            ret = read_systemwide_stats(&system_stats);
+            total_energy_used = energy_interval_total(&energy_before, &energy_after);
+            dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+            package_energy_used = total_energy_used - dram_energy_used;
+            // Walk the subtree, counters of the leaves
+            if (update_cgroup_tree(tree) == -1) {
+                break;
+            }
+            cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
+            system_stats.cycles = cpu_cycles;
+            system_stats.multiplex_ratio = multiplexRatio();
+            for (int i = 0; i < num_packages; i++) {
+                energy_package[i] = energy_interval_package(&energy_before, &energy_after, i);
+            }
+            system_model_counters(&system_stats, &system_counters);
+            update_energy_model(&system_counters, package_energy_used, interval);
+            // Inner nodes have no counters, their own cpu time gets a share of the system cycles
+            estimate_residual_cycles(tree, cycles_package, system_stats.cputime_interval * 1000000ULL / CLK_TCK);
+            for (int i = 0; i < tree->num_nodes; i++)
+            {
+                struct cgroup_node *node = &tree->nodes[i];
+                if (energy_model_is_baseline()) {
+                    node->energy_interval_est = estimate_energy_cycles_packages(cycles_package,
+                        node->cycles_package, energy_package, interval);
+                } else {
+                    cgroup_node_model_counters(node, &entity_counters);
+                    node->energy_interval_est = estimate_energy_model(&system_counters,
+                        &entity_counters, package_energy_used, interval);
+                }
+                node->energy_dram_interval_est = estimate_dram(&system_stats, node->llc_misses_interval,
+                    node->cycles_interval, node->own_memory / 1024, dram_energy_used, interval);
+            }
+            // Parents get the sum of their children plus their own share
+            roll_up_cgroup_energy(tree);
+            for (int i = 0; i < tree->num_nodes; i++) {
+                print_cgroup_node(&tree->nodes[i]);
+            }
+            printf("Interval(%d): total energy (microjoules): %lld, CPU-cycles: %lld, cgroups: %d\n", 
+                interval, total_energy_used, system_stats.cycles, tree->num_nodes);
+            if (logging_enabled == 1) {
+                // Logging, flushed in chunks since a subtree can have many cgroups
+                system_stats_to_buffer(&system_stats, total_energy_used, logging_buffer);
+                for (int i = 0; i < tree->num_nodes; i++)
+                {
+                    cgroup_node_to_buffer(&tree->nodes[i], logging_buffer);
+                    if (strlen(logging_buffer) > sizeof(logging_buffer) - 1024) {
+                        writeToFile(logfile, logging_buffer);
+                    }
+                }
+                writeToFile(logfile, logging_buffer);
+            }
+        }
+        free_cgroup_tree(tree);
+    }
 
-        long long total_energy = 0;
-        long long min_value = __LONG_LONG_MAX__;
-        long long cur_interval = 0;
+    // -p (all processes, cycles sampled per cpu instead of one counter per process)
+    else if (strcmp(argv[1], "-p") == 0)
+    {
+        int fds_sampling[MAX_CPUS];
+        struct sampled_process *sampled;
+        int num_sampled;
+        long long lost_before = 0, lost_interval; // lostSamples() counts since the start
 
-        for (int i = 0; i < measurements-1; i++)
-        {
-            cur_interval = check_overflow(measured_values[i], measured_values[i+1]);
-            if (min_value > cur_interval) {
-                min_value = cur_interval;
+        // Set up system-wide cycles and one sampling event per cpu
+        for (int i = 0; i < MAX_CPUS; i++) {
+            fds_cpu[i] = setUpCpuGroup(i);
+            fds_sampling[i] = setUpCpuSampling(i, 0);
+        }
+        while(1) {
+            begin_energy_window(&energy_before);
+            sleep_energy_window(interval);
+            end_energy_window(&energy_after);
+            ret = read_systemwide_stats(&system_stats);
+            total_energy_used = energy_interval_total(&energy_before, &energy_after);
+            dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+            package_energy_used = total_energy_used - dram_energy_used;
+            cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
+            system_stats.cycles = cpu_cycles;
+            system_stats.multiplex_ratio = multiplexRatio();
+            for (int i = 0; i < num_packages; i++) {
+                energy_package[i] = energy_interval_package(&energy_before, &energy_after, i);
+            }
+            system_model_counters(&system_stats, &system_counters);
+            update_energy_model(&system_counters, package_energy_used, interval);
+            for (int i = 0; i < MAX_CPUS; i++) {
+                readSamples(fds_sampling[i]);
             }
-            total_energy += cur_interval;
+            lost_interval = lostSamples() - lost_before;
+            lost_before += lost_interval;
+            sampled = sampledProcesses(&num_sampled);
+            qsort(sampled, num_sampled, sizeof(struct sampled_process), compare_sampled_processes);
+            // Estimate energy, sampled cycles per socket, only cycles are known per process
+            for (int i = 0; i < num_sampled; i++)
+            {
+                if (energy_model_is_baseline()) {
+                    sampled[i].energy_interval_est = estimate_energy_cycles_packages(cycles_package,
+                        sampled[i].cycles_package, energy_package, interval);
+                } else {
+                    for (int j = 0; j < MODEL_FEATURES; j++) {
+                        entity_counters.values[j] = -1;
+                    }
+                    entity_counters.values[MODEL_CYCLES] = sampled[i].cycles;
+                    sampled[i].energy_interval_est = estimate_energy_model(&system_counters,
+                        &entity_counters, package_energy_used, interval);
+                }
+                sampled[i].energy_dram_interval_est = estimate_dram(&system_stats, -1, sampled[i].cycles, -1,
+                    dram_energy_used, interval);
+                if (i < top_processes) {
+                    print_sampled_process(&sampled[i]);
+                }
+            }
+            printf("Interval(%d): total energy (microjoules): %lld, CPU-cycles: %lld, processes: %d, lost samples: %lld\n", 
+                interval, total_energy_used, system_stats.cycles, num_sampled, lost_interval);
+            if (logging_enabled == 1) {
+                // Logging, flushed in chunks since there can be thousands of processes
+                system_stats_to_buffer(&system_stats, total_energy_used, logging_buffer);
+                for (int i = 0; i < num_sampled; i++)
+                {
+                    sampled_process_to_buffer(&sampled[i], logging_buffer);
+                    if (strlen(logging_buffer) > sizeof(logging_buffer) - 256) {
+                        writeToFile(logfile, logging_buffer);
+                    }
+                }
+                writeToFile(logfile, logging_buffer);
+            }
+            clearSamples();
         }
+    }
 
-        total_energy = total_energy / (measurements-1);
-        // - how much of idle power can be used on processes?
-        // - coefficient to make up for measurements?
-
-        // Save to file
-        FILE *fp = fopen("config_idle.txt", "w");
-        fprintf(fp, "%lld\n%lld\n", total_energy, min_value); // Write total_energy to the file
-        printf("New idle energy consumption (microjoules per second): %lld\n", total_energy);
-        fclose(fp);
-        
-        return 0;
+    // -i (calibration, execute on idle system for idle energy per second, e.g. -i 0.01)
+    else if (strcmp(argv[1], "-i") == 0) 
+    {
+        // stop once the 95% confidence interval is within this fraction of the mean
+        double bound = argc > 2 ? atof(argv[2]) : 0.01;
+        return calibrate_idle(bound);
     }
 
     // -b benchmarking
@@ -403,30 +756,44 @@ int main(int argc, char *argv[]) {
                     ret = read_systemwide_stats(&system_stats);
                     cpu_cycles = 0;
                     for (int i = 0; i < MAX_CPUS; i++) {
-                        fds_cpu[i] = setUpProcCycles_cpu(i);
+                        fds_cpu[i] = setUpCpuGroup(i);
                     }
                     gettimeofday(&start, NULL);
-                    energy_before_pkg = read_energy(0);
-                    energy_before_dram = read_energy(3);
+                    begin_energy_window(&energy_before);
 
                     // Run the command
                     system(command);
 
                     // Measurements
-                    energy_after_pkg = read_energy(0);
-                    energy_after_dram = read_energy(3);
+                    end_energy_window(&energy_after);
                     gettimeofday(&end, NULL);
-                    for (int i = 0; i < MAX_CPUS; i++) {   
-                        cpu_cycles += readInterval(fds_cpu[i]);
-                        closeEvent(fds_cpu[i]);
+                    cpu_cycles = read_cpu_counters(fds_cpu, &system_stats, cycles_package);
+                    for (int i = 0; i < MAX_CPUS; i++) {
+                        closeGroup(fds_cpu[i]);
                     }
                     ret = read_systemwide_stats(&system_stats);
                     read_cgroup_stats(&cg_stats);
                     system_stats.cycles = cpu_cycles;
-                    total_energy_used = check_overflow(energy_before_dram, energy_after_dram) 
-                                        + check_overflow(energy_before_pkg, energy_after_pkg);
+                    system_stats.multiplex_ratio = multiplexRatio();
+                    total_energy_used = energy_interval_total(&energy_before, &energy_after);
+                    dram_energy_used = energy_interval_dram(&energy_before, &energy_after);
+                    package_energy_used = total_energy_used - dram_energy_used;
                     elapsedTime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6;
-                    cg_stats.estimated_energy = estimate_energy_cycles(system_stats.cycles, cg_stats.cycles, total_energy_used, elapsedTime);
+                    for (int i = 0; i < num_packages; i++) {
+                        energy_package[i] = energy_interval_package(&energy_before, &energy_after, i);
+                    }
+                    system_model_counters(&system_stats, &system_counters);
+                    update_energy_model(&system_counters, package_energy_used, elapsedTime);
+                    if (energy_model_is_baseline()) {
+                        cg_stats.estimated_energy = estimate_energy_cycles_packages(cycles_package, cg_stats.cycles_package,
+                                energy_package, elapsedTime);
+                    } else {
+                        cgroup_model_counters(&cg_stats, &entity_counters);
+                        cg_stats.estimated_energy = estimate_energy_model(&system_counters, &entity_counters,
+                                package_energy_used, elapsedTime);
+                    }
+                    cg_stats.estimated_dram_energy = estimate_dram(&system_stats, cg_stats.llc_misses,
+                            cg_stats.cycles, cg_stats.maxRSS / 1024, dram_energy_used, elapsedTime);
                     print_cgroup_stats(&cg_stats);
                     printf("Total energy in microjoules: %lld\n", total_energy_used);
                     printf("Elapsed time: %f\n", elapsedTime);
@@ -451,6 +818,12 @@ int main(int argc, char *argv[]) {
 
     }
 
+    // -x (compare energy of the powercap, perf and msr sources over one interval)
+    else if (strcmp(argv[1], "-x") == 0) 
+    {
+        cross_check_energy_sources(interval);
+    }
+
     // -h help information
     else if (strcmp(argv[1], "-h") == 0) 
     {
@@ -471,7 +844,164 @@ static void print_pinfo(struct proc_stats *p_info) {
     printf("Resident set size change in kB: %ld \n", p_info->rss_interval);
     printf("Number of IO operations: %ld \n", p_info->io_op_interval);
     printf("Number of CPU cycles: %lld \n", p_info->cycles_interval);
+    if (p_info->parent != 0) {
+        printf("Followed child, cycles and energy included in process %d \n", p_info->parent);
+    }
+    if (p_info->multiplex_ratio < 1.0) {
+        printf("Cycles extrapolated, counter ran %.1f%% of the interval \n", p_info->multiplex_ratio * 100);
+    }
+    if (p_info->llc_misses_interval >= 0) {
+        printf("LLC misses: %lld \n", p_info->llc_misses_interval);
+    }
     printf("Estimated energy in microjoules: %lld \n", p_info->energy_interval_est);
+    printf("Estimated DRAM energy in microjoules: %lld \n", p_info->energy_dram_interval_est);
+}
+
+// Memory of a process in kB for its DRAM share, PSS splits shared pages among the processes using them
+static long process_memory(struct proc_stats *p_stats, int use_pss) {
+    if (!use_pss) {
+        return p_stats->rss;
+    }
+    p_stats->pss = read_process_pss(p_stats->pid);
+    return p_stats->pss;
+}
+
+// DRAM share of an entity, memory traffic from LLC misses or from cycles where they are not counted
+static long long estimate_dram(struct system_stats *s_stats, long long llc_misses, long long cycles,
+        long long memory, long long dram_energy, double time) {
+    if (llc_misses >= 0 && s_stats->llc_misses > 0) {
+        return estimate_energy_dram(s_stats->llc_misses, llc_misses, s_stats->rss, memory, dram_energy, time);
+    }
+    return estimate_energy_dram(s_stats->cycles, cycles, s_stats->rss, memory, dram_energy, time);
+}
+
+// Inherited counters of the process, they also count children forked from now on
+static void open_process_counters(struct proc_stats *p_stats) {
+    p_stats->fd = setUpProcCycles(p_stats->pid);
+    p_stats->llc_fd = setUpProcLLCMisses(p_stats->pid);
+    p_stats->num_thread_fds = open_thread_counters(p_stats->pid, &p_stats->thread_fds);
+}
+
+// Start monitoring pid, parent is the monitored process whose inherited counters include it (0 if given
+// by the user). Followed children get no counters of their own, their cycles would be counted twice.
+static int add_process(struct process_table *table, pid_t pid, pid_t parent, int thread_breakdown) {
+    struct proc_stats *p_stats = add_process_entry(table, pid);
+    if (p_stats == NULL) {
+        printf("Process %d not found\n", pid);
+        return -1;
+    }
+    p_stats->parent = parent;
+    if (parent == 0) {
+        open_process_counters(p_stats);
+    }
+    p_stats->threads = thread_breakdown ? init_thread_table() : NULL;
+    read_process_stats(p_stats);
+    if (p_stats->threads != NULL) {
+        read_thread_stats(pid, p_stats->threads);
+    }
+    return 0;
+}
+
+// Last read of an ended process' counters, its events are closed. The followed processes they
+// included open their own.
+static void final_process_counters(struct process_table *table, struct proc_stats *p_stats) {
+    p_stats->cycles_interval = readInterval(p_stats->fd)
+        + read_thread_counters(p_stats->thread_fds, p_stats->num_thread_fds);
+    p_stats->multiplex_ratio = runningRatio(p_stats->fd);
+    closeEvent(p_stats->fd);
+    if (p_stats->llc_fd != -1) {
+        p_stats->llc_misses_interval = readInterval(p_stats->llc_fd);
+        closeEvent(p_stats->llc_fd);
+        p_stats->llc_fd = -1;
+    }
+    close_process_stats(p_stats);
+    close_thread_counters(p_stats->thread_fds, p_stats->num_thread_fds);
+    p_stats->num_thread_fds = 0;
+    free_thread_table(p_stats->threads);
+    p_stats->threads = NULL;
+    p_stats->exited = 1;
+    for (int i = 0; p_stats->parent == 0 && i < table->num; i++) {
+        if (table->entries[i].parent == p_stats->pid && !table->entries[i].exited) {
+            printf("Process %d counted on its own after %d ended\n", table->entries[i].pid, p_stats->pid);
+            table->entries[i].parent = 0;
+            open_process_counters(&table->entries[i]);
+        }
+    }
+}
+
+// Follow children of monitored processes, read the final counters of ended ones right away
+static void handle_proc_events(struct proc_event_info *events, int num_events, struct process_table *table,
+        int thread_breakdown) {
+    for (int e = 0; e < num_events; e++) {
+        struct proc_stats *monitored = find_process_pid(table, events[e].pid);
+        struct proc_stats *parent = find_process_pid(table, events[e].parent);
+        if (monitored != NULL && monitored->exited) {
+            monitored = NULL;
+        }
+        if (events[e].type == PROC_EVENT_FORK && parent != NULL && !parent->exited && monitored == NULL) {
+            printf("Following process %d, forked from %d\n", events[e].pid, events[e].parent);
+            add_process(table, events[e].pid, parent->parent != 0 ? parent->parent : parent->pid,
+                thread_breakdown);
+        } else if (events[e].type == PROC_EVENT_EXEC && monitored != NULL) {
+            printf("Process %d executed a new program\n", events[e].pid);
+        } else if (events[e].type == PROC_EVENT_EXIT && monitored != NULL) {
+            read_process_stats(monitored); // still a zombie, last /proc values
+            final_process_counters(table, monitored);
+        }
+    }
+}
+
+// Keep the host table current, ended processes get their last /proc values
+static void handle_host_events(struct proc_event_info *events, int num_events, struct process_table *table) {
+    for (int e = 0; e < num_events; e++) {
+        if (events[e].type == PROC_EVENT_FORK) {
+            add_process_entry(table, events[e].pid);
+        } else if (events[e].type == PROC_EVENT_EXIT) {
+            struct proc_stats *p_stats = find_process_pid(table, events[e].pid);
+            if (p_stats != NULL && !p_stats->exited) {
+                read_process_stats(p_stats); // still a zombie
+                p_stats->exited = 1;
+            }
+        }
+    }
+}
+
+// Interval statistics of every process in the table, sampled cycles matched by pid
+static void update_host_processes(struct process_table *table, int *stats_ret) {
+    struct sampled_process *sampled;
+    int num_sampled;
+
+    read_process_stats_batch(table->entries, table->num, stats_ret);
+    for (int i = 0; i < table->num; i++) {
+        struct proc_stats *p_stats = &table->entries[i];
+        p_stats->cycles_interval = 0;
+        if (!p_stats->exited && stats_ret[i] == -1) {
+            // gone without notification, nothing left to read
+            p_stats->cputime_interval = 0;
+            p_stats->io_op_interval = 0;
+            p_stats->rss = 0;
+            p_stats->exited = 1;
+        }
+    }
+    sampled = sampledProcesses(&num_sampled);
+    for (int i = 0; i < num_sampled; i++) {
+        struct proc_stats *p_stats = find_process_pid(table, sampled[i].pid);
+        if (p_stats != NULL) {
+            p_stats->cycles_interval = sampled[i].cycles;
+        }
+    }
+}
+
+static void print_thread_breakdown(struct proc_stats *p_info) {
+    int indices[top_threads_printed];
+    int found = top_threads(p_info->threads, indices, top_threads_printed);
+    printf("Threads: %d, most active:\n", p_info->threads->num_current);
+    for (int i = 0; i < found; i++) {
+        struct thread_stats *thread = &p_info->threads->current[indices[i]];
+        printf("  %d (%s): CPU-Time in ms: %.2f, cycles: %lld, estimated energy in microjoules: %lld \n",
+            thread->tid, thread->comm, thread->runtime_interval / 1e6, thread->cycles_interval,
+            thread->energy_interval_est);
+    }
 }
 
 static void print_system_stats(struct system_stats *system_info) {
@@ -481,6 +1011,40 @@ static void print_system_stats(struct system_stats *system_info) {
     printf("Resident set size in kB: %ld \n", system_info->rss_interval);
     printf("Number of I/O operations: %ld \n", system_info->io_op_interval);
     printf("Number of CPU cycles: %lld\n", system_info->cycles);
+    printf("Number of instructions: %lld, LLC misses: %lld\n", system_info->instructions,
+        system_info->llc_misses);
+    if (system_info->multiplex_ratio < 1.0) {
+        printf("Counters multiplexed, lowest running ratio: %.1f%%\n", system_info->multiplex_ratio * 100);
+    }
+    // Hottest core and busiest device, a single one can be saturated while the totals look low
+    int hot_cpu = 0, busy_disk = -1;
+    for (int i = 1; i < system_info->num_cpus; i++) {
+        if (system_info->cpus[i].busy_interval > system_info->cpus[hot_cpu].busy_interval) {
+            hot_cpu = i;
+        }
+    }
+    for (int i = 0; i < system_info->num_disks; i++) {
+        if (busy_disk == -1 || system_info->disks[i].io_ticks_interval > system_info->disks[busy_disk].io_ticks_interval) {
+            busy_disk = i;
+        }
+    }
+    if (system_info->num_cpus > 0) {
+        struct cpu_stats *cpu = &system_info->cpus[hot_cpu];
+        unsigned long long total = cpu->busy_interval + cpu->idle_interval;
+        printf("Busiest CPU: %d, %.1f%% busy\n", hot_cpu, total > 0 ? 100.0 * cpu->busy_interval / total : 0.0);
+    }
+    if (busy_disk != -1) {
+        struct disk_stats *disk = &system_info->disks[busy_disk];
+        printf("Busiest device: %s, %lu reads, %lu writes, %lu ms with I/O in flight\n", disk->name,
+            disk->reads_interval, disk->writes_interval, disk->io_ticks_interval);
+    }
+    if (num_packages > 1) {
+        unsigned long long busy_package[RAPL_MAX_PACKAGES];
+        cpu_busy_packages(system_info, busy_package);
+        for (int i = 0; i < num_packages; i++) {
+            printf("Package %d CPU-Time in seconds: %.2f\n", i, (double) busy_package[i] / CLK_TCK);
+        }
+    }
 }
 
 static void print_container_info(struct container_stats *container) {
@@ -489,8 +1053,60 @@ static void print_container_info(struct container_stats *container) {
     printf("CPU-Time in microseconds: %lu\n", container->cputime_interval);
     printf("Resident set size change in bytes: %lld\n", container->memory_interval);
     printf("IO-operations: %ld\n", container->io_op_interval);
+    printf("User/system CPU-Time in microseconds: %llu/%llu\n", container->counters_interval.user_usec,
+        container->counters_interval.system_usec);
+    if (container->counters_interval.nr_throttled > 0) {
+        printf("Throttled %llu times for %llu microseconds\n", container->counters_interval.nr_throttled,
+            container->counters_interval.throttled_usec);
+    }
+    printf("Memory anon/file/kernel in bytes: %lld/%lld/%lld\n", container->counters.anon,
+        container->counters.file, container->counters.kernel);
+    printf("Stalled in microseconds (some/full), cpu: %llu/%llu, io: %llu/%llu, memory: %llu/%llu\n",
+        container->counters_interval.cpu_some, container->counters_interval.cpu_full,
+        container->counters_interval.io_some, container->counters_interval.io_full,
+        container->counters_interval.memory_some, container->counters_interval.memory_full);
     printf("Number of CPU cycles: %llu\n", container->cycles_interval);
+    if (container->llc_misses_interval >= 0) {
+        printf("LLC misses: %lld\n", container->llc_misses_interval);
+    }
+    if (container->counters_state != CONTAINER_LIVE) {
+        printf("Counters %s, energy not attributed\n", container->counters_state == CONTAINER_PENDING
+            ? "being set up" : "live for part of the interval only");
+        return;
+    }
     printf("Estimated energy in microjoules: %lld\n", container->energy_interval_est);
+    printf("Estimated DRAM energy in microjoules: %lld\n", container->energy_dram_interval_est);
+}
+
+// Own values without the children, energy also for the whole subtree
+static void print_cgroup_node(struct cgroup_node *node) {
+    printf("----------------------------------\n");
+    printf("Cgroup: /%s%s\n", node->path, node->leaf ? " (counted with descendants)" : "");
+    printf("CPU-Time in microseconds: %ld\n", node->own_cputime_interval);
+    printf("Memory in bytes: %lld\n", node->own_memory);
+    printf("IO-operations: %ld\n", node->own_io_op_interval);
+    printf("Throttled in microseconds: %llu, stalled (some) cpu: %llu, io: %llu, memory: %llu\n",
+        node->counters_interval.throttled_usec, node->counters_interval.cpu_some,
+        node->counters_interval.io_some, node->counters_interval.memory_some);
+    printf("Number of CPU cycles: %lld%s\n", node->cycles_interval, node->leaf ? "" : " (by cpu time)");
+    printf("Estimated energy in microjoules: %lld, DRAM: %lld\n", node->energy_interval_est,
+        node->energy_dram_interval_est);
+    printf("Estimated energy of the subtree in microjoules: %lld\n", node->energy_subtree_est);
+}
+
+static void print_sampled_process(struct sampled_process *process) {
+    printf("----------------------------------\n");
+    printf("Process: %d, sampled in last interval:\n", process->pid);
+    printf("Number of CPU cycles: %lld \n", process->cycles);
+    printf("Estimated energy in microjoules: %lld \n", process->energy_interval_est);
+    printf("Estimated DRAM energy in microjoules: %lld \n", process->energy_dram_interval_est);
+}
+
+// Most cycles first
+static int compare_sampled_processes(const void *a, const void *b) {
+    long long cycles_a = ((const struct sampled_process *) a)->cycles;
+    long long cycles_b = ((const struct sampled_process *) b)->cycles;
+    return (cycles_a < cycles_b) - (cycles_a > cycles_b);
 }
 
 static void print_cgroup_stats(struct cgroup_stats *cg) {
@@ -499,16 +1115,105 @@ static void print_cgroup_stats(struct cgroup_stats *cg) {
     printf("Max RSS in bytes: %lld\n", cg->maxRSS);
     printf("IO-operations: %lu; r_bytes: %llu, w_bytes: %llu\n", cg->io_op, cg->r_bytes, cg->w_bytes);
     printf("Number of CPU cycles: %llu\n", cg->cycles);
+    if (cg->llc_misses >= 0) {
+        printf("LLC misses: %lld\n", cg->llc_misses);
+    }
     printf("Estimated energy in microjoules: %lld\n", cg->estimated_energy);
+    printf("Estimated DRAM energy in microjoules: %lld\n", cg->estimated_dram_energy);
+}
+
+// Read every per-cpu event group once, cycles also summed per package
+static long long read_cpu_counters(int *fds_cpu, struct system_stats *s_stats, long long *cycles_package) {
+    struct perf_counters counters;
+    s_stats->cycles = 0;
+    s_stats->instructions = 0;
+    s_stats->llc_misses = 0;
+    memset(cycles_package, 0, sizeof(long long) * RAPL_MAX_PACKAGES);
+    for (int i = 0; i < MAX_CPUS; i++) {
+        readGroupInterval(fds_cpu[i], &counters);
+        s_stats->cycles += counters.cycles;
+        s_stats->instructions += counters.instructions;
+        s_stats->llc_misses += counters.llc_misses;
+        cycles_package[cpu_to_package(i)] += counters.cycles;
+    }
+    return s_stats->cycles;
+}
+
+// Attribution model inputs, memory in kB
+static void system_model_counters(struct system_stats *s_stats, struct model_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    counters->values[MODEL_CYCLES] = s_stats->cycles;
+    counters->values[MODEL_INSTRUCTIONS] = s_stats->instructions;
+    counters->values[MODEL_LLC_MISSES] = s_stats->llc_misses;
+    counters->values[MODEL_IO_OP] = s_stats->io_op_interval;
+    counters->values[MODEL_MEMORY] = s_stats->rss;
+}
+
+static void process_model_counters(struct proc_stats *p_stats, struct model_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    counters->values[MODEL_CYCLES] = p_stats->cycles_interval;
+    counters->values[MODEL_INSTRUCTIONS] = -1; // not counted per entity
+    counters->values[MODEL_LLC_MISSES] = -1;
+    counters->values[MODEL_IO_OP] = p_stats->io_op_interval;
+    counters->values[MODEL_MEMORY] = p_stats->rss;
+}
+
+static void container_model_counters(struct container_stats *c_stats, struct model_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    counters->values[MODEL_CYCLES] = c_stats->cycles_interval;
+    counters->values[MODEL_INSTRUCTIONS] = -1; // not counted per entity
+    counters->values[MODEL_LLC_MISSES] = -1;
+    counters->values[MODEL_IO_OP] = c_stats->io_op_interval;
+    counters->values[MODEL_MEMORY] = c_stats->memory / 1024;
+}
+
+static void cgroup_node_model_counters(struct cgroup_node *node, struct model_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    counters->values[MODEL_CYCLES] = node->cycles_interval;
+    counters->values[MODEL_INSTRUCTIONS] = -1; // not counted per entity
+    counters->values[MODEL_LLC_MISSES] = node->llc_misses_interval;
+    counters->values[MODEL_IO_OP] = node->own_io_op_interval;
+    counters->values[MODEL_MEMORY] = node->own_memory / 1024;
+}
+
+static void cgroup_model_counters(struct cgroup_stats *cg_stats, struct model_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    counters->values[MODEL_CYCLES] = cg_stats->cycles;
+    counters->values[MODEL_INSTRUCTIONS] = -1; // not counted per entity
+    counters->values[MODEL_LLC_MISSES] = -1;
+    counters->values[MODEL_IO_OP] = cg_stats->io_op;
+    counters->values[MODEL_MEMORY] = cg_stats->maxRSS / 1024;
+}
+
+// Drop n arguments after the program name
+static void remove_args(int *argc, char *argv[], int n) {
+    for (int i = 1; i < *argc - n; i++) {
+        argv[i] = argv[i + n];
+    }
+    *argc -= n;
 }
 
 static void print_help() {
     printf("Possible arguments: \n"
-        " -l (logging in combination with others (except -b), has to be first) \n"
+        " -l (logging in combination with others (except -b), before the mode) \n"
+        " -M (attribution model cycles or regression, e.g. -M regression -m 1, before the mode) \n"
+        " -r (energy source powercap, perf, msr or auto, e.g. -r perf -c, before the mode) \n"
+        " -s (sample energy every 1-10 ms in a thread, e.g. -s 5 -m 1, before the mode) \n"
+        " -t (per-thread cycles and energy for -m, split by runtime, e.g. -t -m 1, before the mode) \n"
+        " -n (process cpu time over taskstats netlink instead of /proc/pid/stat, before the mode) \n"
+        " -u (opportunistic rdpmc reads of the per-cpu cgroup counters, only while on their cpu, \n"
+        "     system counters are always read(), before the mode) \n"
+        " -d (DRAM idle energy of processes by PSS from smaps_rollup instead of RSS, before the mode) \n"
         " -e (execute a given command, e.g. -e java myprogram) \n"
         " -m (monitor given processes given by their id, e.g. -m 1 2 3) \n"
-        " -c (monitor running docker containers) \n"
-        " -i (calibration, execute on idle system for idle power) \n"
+        " -c (monitor running docker containers, -c sampling attributes cycles \n"
+        "     from per-cpu samples by cgroup id instead of per-container counters) \n"
+        " -g (monitor a cgroup v2 subtree down to a depth, counters at the deepest cgroups, \n"
+        "     e.g. -g kubepods.slice 2, parents roll up their children's energy) \n"
+        " -p (monitor all processes with per-cpu cycles sampling, top 10 printed) \n"
+        " -i (calibration, execute on idle system for idle power, optional relative \n"
+        "     confidence bound, e.g. -i 0.01 stops at +-1%% of the mean) \n"
         " -b (benchmarking, path to directory with programs and run files) \n"
-        " Running with no arguments or only -l will monitor all active processes.\n");
+        " -x (compare energy readings of powercap, perf and msr for one interval) \n"
+        " Running with no arguments or only -l will monitor all active processes, top 10 printed.\n");
 }
@@ -1,18 +1,165 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/types.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
 #include <asm/unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include "perf_events.h"
 
 static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags)
 {
     return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
 }
 
+/* ///////////////////////////////////////////
+   Multiplexing: with more events than hardware counters the kernel
+   time-shares them, each counter reports how long it was enabled and
+   how long it actually ran. Deltas are scaled by enabled/running and
+   the lowest running ratio since the last query is kept for the logs.
+*/ ///////////////////////////////////////////
+
+struct interval_counter {
+    unsigned long long value;
+    unsigned long long enabled;
+    unsigned long long running;
+    double ratio; // time_running / time_enabled of the last interval
+    int fd; // set while the fd is a tracked counter
+    int cpu; // cpu the event counts on, -1 for task events
+    struct perf_event_mmap_page *page; // NULL unless user-space reads are enabled for a per-cpu event
+};
+
+static struct interval_counter *counters; // indexed by fd
+static int counters_size = 0;
+static double lowest_ratio = 1.0;
+static int use_mmap = 0;
+
+// Map the event's user page for rdpmc reads of counters opened from now on
+void setCounterMmap(int enable) {
+    use_mmap = enable;
+}
+
+static int track_counter(int fd, int cpu) {
+    if (fd < 0) {
+        return -1;
+    }
+    if (fd >= counters_size) {
+        int size = fd + 64;
+        struct interval_counter *resized = realloc(counters, sizeof(struct interval_counter) * size);
+        if (resized == NULL) {
+            printf("Perf counter array allocation failed.\n");
+            close(fd);
+            return -1;
+        }
+        memset(resized + counters_size, 0, sizeof(struct interval_counter) * (size - counters_size));
+        counters = resized;
+        counters_size = size;
+    }
+    memset(&counters[fd], 0, sizeof(struct interval_counter));
+    counters[fd].ratio = 1.0;
+    counters[fd].fd = fd;
+    counters[fd].cpu = cpu;
+    // Task events (other pids, inherited children) are never read with rdpmc, see below
+    if (use_mmap && cpu >= 0) {
+        void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+        counters[fd].page = page == MAP_FAILED ? NULL : page;
+    }
+    return fd;
+}
+
+/* ///////////////////////////////////////////
+   User-space reads: the kernel publishes the hardware counter index,
+   offset and times in the mmap'd event page under a seqlock. rdpmc reads
+   the pmu of the cpu it runs on, while index is non-zero whenever the
+   event is scheduled on any cpu. So only per-cpu events (cpu-wide and
+   cgroup) get a page, and a read is only served while the reader runs on
+   the event's cpu, checked before and after rdpmc. Everything else goes
+   through read().
+*/ ///////////////////////////////////////////
+
+#if defined(__x86_64__) || defined(__i386__)
+static unsigned long long rdpmc(unsigned int counter) {
+    unsigned int low, high;
+    __asm__ volatile("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+    return low | ((unsigned long long) high << 32);
+}
+
+static unsigned long long rdtsc() {
+    unsigned int low, high;
+    __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+    return low | ((unsigned long long) high << 32);
+}
+
+// value, time_enabled, time_running like read(), -1 if the page can not serve the read
+static int read_user_page(struct perf_event_mmap_page *pc, int cpu, unsigned long long *buffer) {
+    unsigned int seq, index;
+    unsigned long long count, enabled, running;
+
+    do {
+        seq = pc->lock;
+        __sync_synchronize();
+        index = pc->index;
+        if (!pc->cap_user_rdpmc || index == 0 || sched_getcpu() != cpu) {
+            return -1;
+        }
+        enabled = pc->time_enabled;
+        running = pc->time_running;
+        if (pc->cap_user_time) { // advance the times to now
+            unsigned long long cycles = rdtsc();
+            unsigned long long quot = cycles >> pc->time_shift;
+            unsigned long long rem = cycles & (((unsigned long long) 1 << pc->time_shift) - 1);
+            unsigned long long delta = pc->time_offset + quot * pc->time_mult
+                + ((rem * pc->time_mult) >> pc->time_shift);
+            enabled += delta;
+            running += delta;
+        }
+        // sign extend the counter to 64 bit before adding the kernel's offset
+        long long pmc = rdpmc(index - 1);
+        pmc <<= 64 - pc->pmc_width;
+        pmc >>= 64 - pc->pmc_width;
+        count = pc->offset + pmc;
+        if (sched_getcpu() != cpu) {
+            return -1; // migrated meanwhile, rdpmc may have read another cpu's pmu
+        }
+        __sync_synchronize();
+    } while (pc->lock != seq);
+
+    buffer[0] = count;
+    buffer[1] = enabled;
+    buffer[2] = running;
+    return 0;
+}
+#else
+static int read_user_page(struct perf_event_mmap_page *pc, int cpu, unsigned long long *buffer) {
+    return -1;
+}
+#endif
+
+// Extrapolate a delta to the whole enabled time, 0 if the counter never ran
+static long long scale_delta(unsigned long long value, unsigned long long enabled,
+        unsigned long long running, double *ratio) {
+    if (enabled == 0) { // not scheduled in this interval at all
+        *ratio = 1.0;
+        return value;
+    }
+    *ratio = (double) running / enabled;
+    if (*ratio < lowest_ratio) {
+        lowest_ratio = *ratio;
+    }
+    if (running == 0) {
+        return 0;
+    }
+    if (running >= enabled) {
+        return value;
+    }
+    return (long long) ((double) value * enabled / running);
+}
+
 int setUpProcCycles(pid_t pid ) {
     struct perf_event_attr pe;
     int fd;
@@ -22,22 +169,24 @@ int setUpProcCycles(pid_t pid ) {
     pe.type = PERF_TYPE_HARDWARE;
     pe.config = PERF_COUNT_HW_CPU_CYCLES;  // Measure CPU cycles
     pe.disabled = 1;  // Start the counter in a disabled state
+    pe.inherit = 1;  // Count threads and children created after the attach
     pe.exclude_kernel = 0;  // Include kernel space measurement
     pe.exclude_hv = 1;  // Exclude hypervisor from measurement
+    pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
     pe.size = sizeof(struct perf_event_attr);
 
     // Open event counter
     fd = perf_event_open(&pe, pid, -1, -1, 0);
     if (fd == -1) {
         printf("Error opening perf event proc\n");
-        return 1;
+        return -1;
     }
 
     // Clear and enable event counter
     ioctl(fd, PERF_EVENT_IOC_RESET, 0);
     ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
 
-    return fd;
+    return track_counter(fd, -1);
 }
 
 int setUpProcCycles_cpu(int cpu) {
@@ -51,24 +200,26 @@ int setUpProcCycles_cpu(int cpu) {
     pe.disabled = 1;  // Start the counter in a disabled state
     pe.exclude_kernel = 0;  // Include kernel space measurement
     pe.exclude_hv = 1;  // Exclude hypervisor from measurement
+    pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
     pe.size = sizeof(struct perf_event_attr);
 
     // Open event counter
     fd = perf_event_open(&pe, -1, cpu, -1, 0);
     if (fd == -1) {
         printf("Error opening perf event cpu\n");
-        return 1;
+        return -1;
     }
 
     // Clear and enable event counter
     ioctl(fd, PERF_EVENT_IOC_RESET, 0);
     ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
 
-    return fd;
+    return track_counter(fd, cpu);
 }
 
-// todo possibly open all cpus as group event
-int setUpProcCycles_cgroup(int cgroup_fd, int cpu) {
+// Enabled but not tracked yet, safe to call from other threads. trackCounter makes the fd usable
+// with readInterval, in the thread that reads the counters.
+int openCgroupCycles(int cgroup_fd, int cpu) {
     struct perf_event_attr pe;
     int fd;
 
@@ -79,6 +230,7 @@ int setUpProcCycles_cgroup(int cgroup_fd, int cpu) {
     pe.disabled = 1;  // Start the counter in a disabled state
     pe.exclude_kernel = 0;  // Include kernel space measurement
     pe.exclude_hv = 1;  // Exclude hypervisor from measurement
+    pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
     pe.size = sizeof(struct perf_event_attr);
 
     // Open event counter
@@ -87,7 +239,7 @@ int setUpProcCycles_cgroup(int cgroup_fd, int cpu) {
     fd = perf_event_open(&pe, cgroup_fd, cpu, -1, flag);
     if (fd == -1) {
         printf("Error opening perf event cgroup\n");
-        return 1;
+        return -1;
     }
 
     // Clear and enable event counter
@@ -97,19 +249,232 @@ int setUpProcCycles_cgroup(int cgroup_fd, int cpu) {
     return fd;
 }
 
+// todo possibly open all cpus as group event
+int setUpProcCycles_cgroup(int cgroup_fd, int cpu) {
+    return track_counter(openCgroupCycles(cgroup_fd, cpu), cpu);
+}
+
+int trackCounter(int fd, int cpu) {
+    return track_counter(fd, cpu);
+}
+
+// Last level cache read misses, the memory traffic DRAM energy is split by
+static int open_llc_misses_untracked(pid_t pid, int cpu, unsigned long flags) {
+    struct perf_event_attr pe;
+    int fd;
+
+    memset(&pe, 0, sizeof(struct perf_event_attr));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);  // same event as in the cpu groups
+    pe.disabled = 1;
+    pe.inherit = pid != -1 && !(flags & PERF_FLAG_PID_CGROUP);  // threads and children of a process
+    pe.exclude_kernel = 0;
+    pe.exclude_hv = 1;
+    pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    pe.size = sizeof(struct perf_event_attr);
+
+    fd = perf_event_open(&pe, pid, cpu, -1, flags);
+    if (fd == -1) {
+        return -1; // e.g. no LLC event on this pmu, DRAM is split by cycles then
+    }
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    return fd;
+}
+
+static int open_llc_misses(pid_t pid, int cpu, unsigned long flags) {
+    return track_counter(open_llc_misses_untracked(pid, cpu, flags), cpu);
+}
+
+int setUpProcLLCMisses(pid_t pid) {
+    return open_llc_misses(pid, -1, 0);
+}
+
+int setUpProcLLCMisses_cgroup(int cgroup_fd, int cpu) {
+    return open_llc_misses(cgroup_fd, cpu, PERF_FLAG_PID_CGROUP);
+}
+
+// Like openCgroupCycles
+int openCgroupLLCMisses(int cgroup_fd, int cpu) {
+    return open_llc_misses_untracked(cgroup_fd, cpu, PERF_FLAG_PID_CGROUP);
+}
+
 long long readInterval(int fd) {
-    long long counter;
+    unsigned long long buffer[3]; // value, time_enabled, time_running
     // Read counting event counter
-    read(fd, &counter, sizeof(long long));
-    // Reset counter, or implement overflow 
-    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    if (fd < 0 || fd >= counters_size || counters[fd].fd != fd) {
+        return 0;
+    }
+    if ((counters[fd].page == NULL || read_user_page(counters[fd].page, counters[fd].cpu, buffer) == -1)
+            && read(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+        return 0;
+    }
+    // Diff against the previous read instead of resetting, times can not be reset
+    struct interval_counter *c = &counters[fd];
+    long long counter = scale_delta(buffer[0] - c->value, buffer[1] - c->enabled,
+            buffer[2] - c->running, &c->ratio);
+    c->value = buffer[0];
+    c->enabled = buffer[1];
+    c->running = buffer[2];
     //printf("CPU cycles: %llu\n", counter);
     return counter;
 }
 
+// Running ratio of the counter's last interval, 1 if it was never multiplexed
+double runningRatio(int fd) {
+    if (fd < 0 || fd >= counters_size || counters[fd].fd != fd) {
+        return 1.0;
+    }
+    return counters[fd].ratio;
+}
+
+// Lowest running ratio of all counters read since the last call
+double multiplexRatio() {
+    double ratio = lowest_ratio;
+    lowest_ratio = 1.0;
+    return ratio;
+}
+
+/* ///////////////////////////////////////////
+   Per-cpu event groups: cycles leads, instructions, ref-cycles and
+   LLC misses follow. One read per group with PERF_FORMAT_GROUP |
+   PERF_FORMAT_ID, values are diffed against the previous read
+   instead of resetting the counters.
+*/ ///////////////////////////////////////////
+
+#define GROUP_EVENTS 4
+
+struct perf_group {
+    int fds[GROUP_EVENTS]; // -1 if the event is not supported
+    unsigned long long ids[GROUP_EVENTS];
+    unsigned long long previous[GROUP_EVENTS];
+    unsigned long long enabled; // members are scheduled with the leader
+    unsigned long long running;
+};
+
+static struct perf_group *groups; // indexed by leader fd
+static int groups_size = 0;
+
+static const struct { unsigned int type; unsigned long long config; } group_events[GROUP_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+int setUpCpuGroup(int cpu) {
+    struct perf_event_attr pe;
+    int leader = -1;
+    struct perf_group group;
+    group.enabled = 0;
+    group.running = 0;
+
+    for (int i = 0; i < GROUP_EVENTS; i++) {
+        memset(&pe, 0, sizeof(struct perf_event_attr));
+        pe.type = group_events[i].type;
+        pe.config = group_events[i].config;
+        pe.disabled = leader == -1;  // Leader starts disabled, members follow it
+        pe.exclude_kernel = 0;  // Include kernel space measurement
+        pe.exclude_hv = 1;  // Exclude hypervisor from measurement
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID
+                | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pe.size = sizeof(struct perf_event_attr);
+
+        group.fds[i] = perf_event_open(&pe, -1, cpu, leader, 0);
+        group.ids[i] = 0;
+        group.previous[i] = 0;
+        if (group.fds[i] == -1) {
+            if (leader == -1) {
+                printf("Error opening perf event group cpu\n");
+                return -1;
+            }
+            continue; // e.g. no LLC event on this pmu
+        }
+        ioctl(group.fds[i], PERF_EVENT_IOC_ID, &group.ids[i]);
+        if (leader == -1) {
+            leader = group.fds[i];
+        }
+    }
+
+    if (leader >= groups_size) {
+        int size = leader + 64;
+        struct perf_group *resized = realloc(groups, sizeof(struct perf_group) * size);
+        if (resized == NULL) {
+            printf("Perf group array allocation failed.\n");
+            return -1;
+        }
+        memset(resized + groups_size, 0, sizeof(struct perf_group) * (size - groups_size));
+        groups = resized;
+        groups_size = size;
+    }
+    groups[leader] = group;
+
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    return leader;
+}
+
+// Counts since the last call scaled for multiplexing, one read syscall for the whole group
+int readGroupInterval(int fd, struct perf_counters *counters) {
+    unsigned long long buffer[3 + 2 * GROUP_EVENTS]; // nr, time_enabled, time_running, {value, id}...
+    long long delta[GROUP_EVENTS] = {0};
+    double ratio;
+
+    memset(counters, 0, sizeof(*counters));
+    if (fd < 0 || fd >= groups_size || groups[fd].fds[0] != fd
+            || read(fd, buffer, sizeof(buffer)) <= 0) {
+        return -1;
+    }
+    struct perf_group *group = &groups[fd];
+    unsigned long long enabled = buffer[1] - group->enabled;
+    unsigned long long running = buffer[2] - group->running;
+    group->enabled = buffer[1];
+    group->running = buffer[2];
+    for (unsigned long long i = 0; i < buffer[0] && i < GROUP_EVENTS; i++) {
+        unsigned long long value = buffer[3 + 2 * i];
+        unsigned long long id = buffer[4 + 2 * i];
+        for (int j = 0; j < GROUP_EVENTS; j++) {
+            if (group->fds[j] != -1 && group->ids[j] == id) {
+                delta[j] = scale_delta(value - group->previous[j], enabled, running, &ratio);
+                group->previous[j] = value;
+                break;
+            }
+        }
+    }
+    counters->cycles = delta[0];
+    counters->instructions = delta[1];
+    counters->ref_cycles = delta[2];
+    counters->llc_misses = delta[3];
+    return 0;
+}
+
+int closeGroup(int fd) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (fd >= 0 && fd < groups_size && groups[fd].fds[0] == fd) {
+        for (int i = GROUP_EVENTS - 1; i > 0; i--) {
+            if (groups[fd].fds[i] != -1) {
+                close(groups[fd].fds[i]);
+            }
+        }
+        groups[fd].fds[0] = 0;
+    }
+    return close(fd);
+}
+
 int closeEvent(int fd) {
     // Disable the counter and read the counter value
     ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (fd >= 0 && fd < counters_size) {
+        if (counters[fd].page != NULL) {
+            munmap(counters[fd].page, sysconf(_SC_PAGESIZE));
+            counters[fd].page = NULL;
+        }
+        counters[fd].fd = 0;
+    }
 
     // Close the perf event
     close(fd);
@@ -136,11 +501,18 @@ int initEnergy() {
 
     // check rapl pkg event id
     fd = fopen("/sys/bus/event_source/devices/power/events/energy-pkg", "r");
+    if (fd == NULL) {
+        printf("No energy-pkg event \n");
+        return -1;
+    }
     fscanf(fd, "event=%x", &pkg_config);
     fclose(fd);
 
     // check scale
     fd = fopen("/sys/bus/event_source/devices/power/events/energy-pkg.scale", "r");
+    if (fd == NULL) {
+        return -1;
+    }
     fscanf(fd,"%lf",&pkg_scale);
     fclose(fd);
 
@@ -154,6 +526,9 @@ int initEnergy() {
 
     // check scale
     fd = fopen("/sys/bus/event_source/devices/power/events/energy-ram.scale", "r");
+    if (fd == NULL) {
+        return 1;
+    }
     fscanf(fd,"%lf",&ram_scale);
     fclose(fd);
 
@@ -219,6 +594,59 @@ double readEnergyInterval(int fd, int type) {
     }
 }
 
+// pkg as group leader and ram as member on the lead cpu of a socket, ram only if with_ram.
+// ram_fd is -1 without the member, closeEnergyGroup closes both.
+int openEnergyGroup(int cpu, int with_ram, int *ram_fd) {
+    struct perf_event_attr pe;
+    int fd;
+
+    *ram_fd = -1;
+    memset(&pe, 0x0, sizeof(pe));
+    pe.type = energy_event_type;
+    pe.config = pkg_config;
+    pe.size = sizeof(struct perf_event_attr);
+    pe.read_format = PERF_FORMAT_GROUP;
+    pe.disabled = 1;
+    fd = perf_event_open(&pe, -1, cpu, -1, 0);
+    if (fd==-1) {
+        printf("Error opening energy-pkg event \n");
+        return -1;
+    }
+    if (with_ram) {
+        pe.config = ram_config;
+        pe.disabled = 0; // follows the leader
+        *ram_fd = perf_event_open(&pe, -1, cpu, fd, 0);
+        if (*ram_fd == -1) {
+            printf("Error opening energy-ram event \n");
+        }
+    }
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    return fd;
+}
+
+void closeEnergyGroup(int fd, int ram_fd) {
+    if (ram_fd != -1) {
+        close(ram_fd);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+// One read for pkg and ram, counters keep running, values in microjoules since open
+int readEnergyGroup(int fd, long long *pkg, long long *ram) {
+    unsigned long long values[3] = {0}; // nr, pkg, ram
+    if (read(fd, values, sizeof(values)) < (ssize_t) (2 * sizeof(unsigned long long))) {
+        return -1;
+    }
+    *pkg = (long long) (values[1] * pkg_scale * 1e6);
+    *ram = values[0] > 1 ? (long long) (values[2] * ram_scale * 1e6) : 0;
+    return 0;
+}
+
 /* 
 int main(int argc, char **argv)
 {
@@ -3,14 +3,43 @@
 
 #include <sys/types.h>
 
+struct perf_counters {
+    long long cycles;
+    long long instructions;
+    long long ref_cycles;
+    long long llc_misses;
+};
+
 int setUpProcCycles(pid_t pid);
 
 int setUpProcCycles_cpu(int cpu);
 
 int setUpProcCycles_cgroup(int cgroup_fd, int cpu);
 
+int setUpProcLLCMisses(pid_t pid);
+
+int setUpProcLLCMisses_cgroup(int cgroup_fd, int cpu);
+
+int openCgroupCycles(int cgroup_fd, int cpu);
+
+int openCgroupLLCMisses(int cgroup_fd, int cpu);
+
+int trackCounter(int fd, int cpu);
+
+void setCounterMmap(int enable);
+
 long long readInterval(int fd);
 
+double runningRatio(int fd);
+
+double multiplexRatio();
+
+int setUpCpuGroup(int cpu);
+
+int readGroupInterval(int fd, struct perf_counters *counters);
+
+int closeGroup(int fd);
+
 int initEnergy();
 
 int openPkgEvent();
@@ -19,6 +48,12 @@ int openRamEvent();
 
 double readEnergyInterval(int fd, int i);
 
+int openEnergyGroup(int cpu, int with_ram, int *ram_fd);
+
+void closeEnergyGroup(int fd, int ram_fd);
+
+int readEnergyGroup(int fd, long long *pkg, long long *ram);
+
 int closeEvent(int fd);
 
 
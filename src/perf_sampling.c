@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <asm/unistd.h>
+#include "energy.h"
+#include "perf_sampling.h"
+
+/* ///////////////////////////////////////////
+   All-process attribution with a fixed number of fds: one cycles
+   sampling event per cpu writes (pid, cpu, period) records into an
+   mmap'd ring buffer. Periods are summed per pid in a hash table,
+   which gives every process its cycles of the interval. With
+   PERF_SAMPLE_CGROUP they are also summed per cgroup id, so containers
+   coming and going need no perf setup at all.
+*/ ///////////////////////////////////////////
+
+struct sample_record {
+    struct perf_event_header header;
+    unsigned int pid, tid; // PERF_SAMPLE_TID
+    unsigned int cpu, res; // PERF_SAMPLE_CPU
+    unsigned long long period; // PERF_SAMPLE_PERIOD
+    unsigned long long cgroup; // PERF_SAMPLE_CGROUP, only with cgroup sampling
+};
+
+struct lost_record {
+    struct perf_event_header header;
+    unsigned long long id;
+    unsigned long long lost;
+};
+
+struct sampling_ring {
+    int fd;
+    int cgroup; // records carry the cgroup id
+    struct perf_event_mmap_page *page; // followed by the data pages
+    char *data;
+    size_t size; // of the data area
+};
+
+static struct sampling_ring *rings; // indexed by fd
+static int rings_size = 0;
+
+// Dense array of this interval's entries, key -> index + 1 in an open addressing table
+struct sample_table {
+    unsigned long long *keys; // pid or cgroup id of each entry
+    struct sampled_process *entries;
+    int num;
+    int size;
+    int *slots;
+    int slots_size; // power of two
+};
+
+static struct sample_table process_table;
+static struct sample_table cgroup_table;
+static long long lost = 0;
+
+static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
+}
+
+static unsigned int hash_key(unsigned long long key) {
+    return (unsigned int) ((key ^ (key >> 32)) * 2654435761u);
+}
+
+static int grow_slots(struct sample_table *table) {
+    int size = table->slots_size == 0 ? 1024 : table->slots_size * 2;
+    int *resized = calloc(size, sizeof(int));
+    if (resized == NULL) {
+        printf("Sampling table allocation failed.\n");
+        return -1;
+    }
+    for (int i = 0; i < table->num; i++) {
+        unsigned int slot = hash_key(table->keys[i]) & (size - 1);
+        while (resized[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        resized[slot] = i + 1;
+    }
+    free(table->slots);
+    table->slots = resized;
+    table->slots_size = size;
+    return 0;
+}
+
+// Slot of the key, or of the empty slot it would go into
+static unsigned int find_slot(struct sample_table *table, unsigned long long key) {
+    unsigned int slot = hash_key(key) & (table->slots_size - 1);
+    while (table->slots[slot] != 0 && table->keys[table->slots[slot] - 1] != key) {
+        slot = (slot + 1) & (table->slots_size - 1);
+    }
+    return slot;
+}
+
+static struct sampled_process *lookup_entry(struct sample_table *table, unsigned long long key) {
+    // keep the load below 70%
+    if (table->num * 10 >= table->slots_size * 7 && grow_slots(table) == -1) {
+        return NULL;
+    }
+    unsigned int slot = find_slot(table, key);
+    if (table->slots[slot] != 0) {
+        return &table->entries[table->slots[slot] - 1];
+    }
+
+    if (table->num == table->size) {
+        int size = table->size == 0 ? 1024 : table->size * 2;
+        struct sampled_process *entries = realloc(table->entries, sizeof(struct sampled_process) * size);
+        if (entries == NULL) {
+            printf("Sampling entry array allocation failed.\n");
+            return NULL;
+        }
+        table->entries = entries;
+        unsigned long long *keys = realloc(table->keys, sizeof(unsigned long long) * size);
+        if (keys == NULL) {
+            printf("Sampling entry array allocation failed.\n");
+            return NULL;
+        }
+        table->keys = keys;
+        table->size = size;
+    }
+    struct sampled_process *p = &table->entries[table->num];
+    memset(p, 0, sizeof(struct sampled_process));
+    table->keys[table->num] = key;
+    table->slots[slot] = ++table->num;
+    return p;
+}
+
+static void clear_table(struct sample_table *table) {
+    table->num = 0;
+    if (table->slots != NULL) {
+        memset(table->slots, 0, sizeof(int) * table->slots_size);
+    }
+}
+
+static struct sampled_process *add_sample(struct sample_table *table, unsigned long long key,
+        struct sample_record *sample) {
+    struct sampled_process *p = lookup_entry(table, key);
+    if (p != NULL) {
+        p->cycles += sample->period;
+        p->cycles_package[cpu_to_package(sample->cpu)] += sample->period;
+    }
+    return p;
+}
+
+// With cgroup set, samples also carry the cgroup id of the task (Linux 5.7+)
+int setUpCpuSampling(int cpu, int cgroup) {
+    struct perf_event_attr pe;
+    int fd;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    // Create event attribute
+    memset(&pe, 0, sizeof(struct perf_event_attr));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.config = PERF_COUNT_HW_CPU_CYCLES;  // Sample CPU cycles
+    pe.sample_freq = SAMPLING_FREQUENCY;
+    pe.freq = 1;  // Kernel adapts the period, PERF_SAMPLE_PERIOD reports it
+    pe.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD;
+    if (cgroup) {
+        pe.sample_type |= PERF_SAMPLE_CGROUP;
+    }
+    pe.disabled = 1;  // Start the counter in a disabled state
+    pe.exclude_kernel = 0;  // Include kernel space measurement
+    pe.exclude_hv = 1;  // Exclude hypervisor from measurement
+    pe.size = sizeof(struct perf_event_attr);
+
+    // Open event counter
+    fd = perf_event_open(&pe, -1, cpu, -1, 0);
+    if (fd == -1) {
+        printf("Error opening perf sampling event cpu\n");
+        return -1;
+    }
+
+    void *page = mmap(NULL, (1 + SAMPLING_PAGES) * page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        perror("Sampling ring buffer mmap failed");
+        close(fd);
+        return -1;
+    }
+
+    if (fd >= rings_size) {
+        int size = fd + 64;
+        struct sampling_ring *resized = realloc(rings, sizeof(struct sampling_ring) * size);
+        if (resized == NULL) {
+            printf("Sampling ring array allocation failed.\n");
+            munmap(page, (1 + SAMPLING_PAGES) * page_size);
+            close(fd);
+            return -1;
+        }
+        memset(resized + rings_size, 0, sizeof(struct sampling_ring) * (size - rings_size));
+        rings = resized;
+        rings_size = size;
+    }
+    rings[fd].fd = fd;
+    rings[fd].cgroup = cgroup;
+    rings[fd].page = page;
+    rings[fd].data = (char *) page + page_size;
+    rings[fd].size = SAMPLING_PAGES * page_size;
+
+    // Clear and enable event counter
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    return fd;
+}
+
+// Consume all records of the cpu's ring buffer, returns the number of samples
+int readSamples(int fd) {
+    if (fd < 0 || fd >= rings_size || rings[fd].fd != fd) {
+        return -1;
+    }
+    struct sampling_ring *ring = &rings[fd];
+    unsigned long long head = __atomic_load_n(&ring->page->data_head, __ATOMIC_ACQUIRE);
+    unsigned long long tail = ring->page->data_tail;
+    int samples = 0;
+    char record[256];
+
+    while (tail < head) {
+        size_t offset = tail % ring->size;
+        struct perf_event_header *header = (struct perf_event_header *) (ring->data + offset);
+        size_t length = header->size;
+        if (length == 0 || length > sizeof(record)) {
+            break; // corrupted, drop the rest
+        }
+        // records may wrap around the end of the data area
+        if (offset + length > ring->size) {
+            size_t first = ring->size - offset;
+            memcpy(record, ring->data + offset, first);
+            memcpy(record + first, ring->data, length - first);
+            header = (struct perf_event_header *) record;
+        }
+
+        if (header->type == PERF_RECORD_SAMPLE) {
+            struct sample_record *sample = (struct sample_record *) header;
+            struct sampled_process *p = add_sample(&process_table, sample->pid, sample);
+            if (p != NULL) {
+                p->pid = sample->pid;
+            }
+            if (ring->cgroup) {
+                add_sample(&cgroup_table, sample->cgroup, sample);
+            }
+            samples++;
+        } else if (header->type == PERF_RECORD_LOST) {
+            lost += ((struct lost_record *) header)->lost;
+        }
+        tail += length;
+    }
+    __atomic_store_n(&ring->page->data_tail, head, __ATOMIC_RELEASE);
+    return samples;
+}
+
+// Processes sampled since the last clearSamples, valid until the next readSamples
+struct sampled_process *sampledProcesses(int *count) {
+    *count = process_table.num;
+    return process_table.entries;
+}
+
+// Cycles sampled in the cgroup since the last clearSamples, split by socket
+long long sampledCgroupCycles(unsigned long long cgroup_id, long long *cycles_package) {
+    memset(cycles_package, 0, sizeof(long long) * RAPL_MAX_PACKAGES);
+    if (cgroup_table.slots_size == 0) {
+        return 0;
+    }
+    unsigned int slot = find_slot(&cgroup_table, cgroup_id);
+    if (cgroup_table.slots[slot] == 0) {
+        return 0;
+    }
+    struct sampled_process *p = &cgroup_table.entries[cgroup_table.slots[slot] - 1];
+    memcpy(cycles_package, p->cycles_package, sizeof(long long) * RAPL_MAX_PACKAGES);
+    return p->cycles;
+}
+
+void clearSamples() {
+    clear_table(&process_table);
+    clear_table(&cgroup_table);
+}
+
+// Samples the kernel dropped because a ring buffer was full
+long long lostSamples() {
+    return lost;
+}
+
+int closeSampling(int fd) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (fd >= 0 && fd < rings_size && rings[fd].fd == fd) {
+        munmap(rings[fd].page, (1 + SAMPLING_PAGES) * sysconf(_SC_PAGESIZE));
+        rings[fd].fd = 0;
+    }
+    return close(fd);
+}
@@ -0,0 +1,32 @@
+#ifndef perf_sampling_h
+#define perf_sampling_h
+
+#include <sys/types.h>
+#include "energy.h"
+
+#define SAMPLING_PAGES 32 // ring buffer data pages per cpu, power of two
+#define SAMPLING_FREQUENCY 1000 // cycles samples per second and cpu
+
+struct sampled_process {
+    pid_t pid;
+    long long cycles; // sum of sample periods in the interval
+    long long cycles_package[RAPL_MAX_PACKAGES]; // cycles split by socket
+    long long energy_interval_est; // package share, in microjoules
+    long long energy_dram_interval_est; // DRAM share, in microjoules
+};
+
+int setUpCpuSampling(int cpu, int cgroup);
+
+int readSamples(int fd);
+
+struct sampled_process *sampledProcesses(int *count);
+
+long long sampledCgroupCycles(unsigned long long cgroup_id, long long *cycles_package);
+
+void clearSamples();
+
+long long lostSamples();
+
+int closeSampling(int fd);
+
+#endif
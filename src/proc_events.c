@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "proc_events.h"
+
+/* ///////////////////////////////////////////
+   Process lifecycle over the netlink proc connector (needs
+   CAP_NET_ADMIN): the kernel multicasts fork, exec and exit of every
+   task once we send PROC_CN_MCAST_LISTEN. Exits arrive while the
+   process is still a zombie, so its counters and /proc files can be
+   read one last time.
+*/ ///////////////////////////////////////////
+
+static int nl_fd = -1;
+
+static int send_mcast_op(enum proc_cn_mcast_op op) {
+    char buffer[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    memset(buffer, 0, sizeof(buffer));
+    struct nlmsghdr *nl_header = (struct nlmsghdr *) buffer;
+    struct cn_msg *cn_message = NLMSG_DATA(nl_header);
+
+    nl_header->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+    nl_header->nlmsg_type = NLMSG_DONE;
+    nl_header->nlmsg_pid = getpid();
+    cn_message->id.idx = CN_IDX_PROC;
+    cn_message->id.val = CN_VAL_PROC;
+    cn_message->len = sizeof(op);
+    memcpy(cn_message->data, &op, sizeof(op));
+
+    if (send(nl_fd, nl_header, nl_header->nlmsg_len, 0) == -1) {
+        perror("Couldn't subscribe to proc connector");
+        return -1;
+    }
+    return 0;
+}
+
+int init_proc_events() {
+    nl_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (nl_fd == -1) {
+        perror("Couldn't open netlink connector socket");
+        return -1;
+    }
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    address.nl_pid = 0; // assigned by the kernel
+    if (bind(nl_fd, (struct sockaddr *) &address, sizeof(address)) == -1
+            || send_mcast_op(PROC_CN_MCAST_LISTEN) == -1) {
+        perror("Couldn't bind proc connector");
+        close(nl_fd);
+        nl_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Waits up to timeout_ms for events, returns how many were stored (0 on timeout)
+int wait_proc_events(int timeout_ms, struct proc_event_info *events, int max) {
+    struct pollfd pfd = {nl_fd, POLLIN, 0};
+    char buffer[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int count = 0;
+
+    if (nl_fd == -1 || poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    ssize_t length;
+    while (count < max && (length = recv(nl_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        struct nlmsghdr *nl_header = (struct nlmsghdr *) buffer;
+        for (; NLMSG_OK(nl_header, length) && count < max; nl_header = NLMSG_NEXT(nl_header, length)) {
+            if (nl_header->nlmsg_type == NLMSG_ERROR || nl_header->nlmsg_type == NLMSG_NOOP) {
+                continue;
+            }
+            struct cn_msg *cn_message = NLMSG_DATA(nl_header);
+            if (cn_message->id.idx != CN_IDX_PROC || cn_message->id.val != CN_VAL_PROC) {
+                continue;
+            }
+            struct proc_event *event = (struct proc_event *) cn_message->data;
+            struct proc_event_info *info = &events[count];
+            switch (event->what) {
+                case PROC_EVENT_FORK:
+                    // new threads share the tgid, only new processes are of interest
+                    if (event->event_data.fork.child_pid != event->event_data.fork.child_tgid) {
+                        continue;
+                    }
+                    info->pid = event->event_data.fork.child_tgid;
+                    info->parent = event->event_data.fork.parent_tgid;
+                    break;
+                case PROC_EVENT_EXEC:
+                    info->pid = event->event_data.exec.process_tgid;
+                    info->parent = 0;
+                    break;
+                case PROC_EVENT_EXIT:
+                    // whole process once the thread group leader exits
+                    if (event->event_data.exit.process_pid != event->event_data.exit.process_tgid) {
+                        continue;
+                    }
+                    info->pid = event->event_data.exit.process_tgid;
+                    info->parent = 0;
+                    break;
+                default:
+                    continue;
+            }
+            info->type = event->what;
+            count++;
+        }
+    }
+    return count;
+}
+
+void close_proc_events() {
+    if (nl_fd == -1) {
+        return;
+    }
+    send_mcast_op(PROC_CN_MCAST_IGNORE);
+    close(nl_fd);
+    nl_fd = -1;
+}
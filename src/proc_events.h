@@ -0,0 +1,23 @@
+#ifndef proc_events_h
+#define proc_events_h
+
+#include <sys/types.h>
+#include <linux/cn_proc.h>
+
+#define PROC_EVENTS_MAX 64 // events handled per wakeup
+
+// PROC_EVENT_FORK, PROC_EVENT_EXEC or PROC_EVENT_EXIT of whole processes, threads are filtered out
+struct proc_event_info
+{
+    int type;
+    pid_t pid; // child on fork
+    pid_t parent; // only for fork
+};
+
+int init_proc_events();
+
+int wait_proc_events(int timeout_ms, struct proc_event_info *events, int max);
+
+void close_proc_events();
+
+#endif
@@ -1,34 +1,124 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <string.h>
 #include "energy.h"
+#include "process_stats.h"
 
 // CPU-Time, I/O, Memory used
 
-struct proc_stats { 
-    pid_t pid;
-    unsigned long cputime; // in clock ticks, divide by sysconf(_SC_CLK_TCK) for seconds
-    long rss; // in kilobytes
-    long io_op; 
-    unsigned long cputime_interval;
-    long rss_interval;
-    long io_op_interval;
-    long long cycles_interval;
-    int fd;
-    long long energy_interval_est; // in microjoules
-};
-
-struct system_stats {
-    unsigned long cputime; // in clock ticks, divide by sysconf(_SC_CLK_TCK) for seconds
-    long rss; // in kilobytes
-    long io_op;
-    unsigned long cputime_interval;
-    long rss_interval;
-    long io_op_interval;
-    long long cycles;
-};
+/* ///////////////////////////////////////////
+   /proc files stay open and are re-read with pread at offset 0 into one
+   reusable buffer that grows to the largest file, parsed with plain
+   digit scanners instead of stdio.
+   The per-process files are opened on the first read and closed with
+   close_process_stats, the system-wide files stay open for the run.
+   A held /proc/pid file fails with ESRCH once the process is gone, so
+   a reused pid is never read as the old process. Not thread safe.
+*/ ///////////////////////////////////////////
 
+#define PROC_BUFFER 16384 // initial size, doubled while a file fills it
+#define PROC_BUFFER_MAX (4 << 20)
+
+static char *proc_buffer = NULL;
+static int proc_buffer_size = 0;
+static int stat_fd = -1;
+static int meminfo_fd = -1;
+static int diskstats_fd = -1;
+
+static int grow_proc_buffer() {
+    int size = proc_buffer_size == 0 ? PROC_BUFFER : proc_buffer_size * 2;
+    char *buffer = size > PROC_BUFFER_MAX ? NULL : realloc(proc_buffer, size);
+    if (buffer == NULL) {
+        return -1;
+    }
+    proc_buffer = buffer;
+    proc_buffer_size = size;
+    return 0;
+}
+
+/* Whole file into proc_buffer, returns the length or -1. Files shown as one
+   record come in one read, so a short read ends them. Files listed record by
+   record (paged, e.g. diskstats) return at most a page per read until 0. */
+static int read_proc_file(int fd, int paged) {
+    int length = 0;
+    ssize_t ret;
+    while (1) {
+        if (length >= proc_buffer_size - 1 && grow_proc_buffer() == -1) {
+            if (proc_buffer == NULL) {
+                printf("Couldn't allocate the /proc buffer\n");
+                return -1;
+            }
+            printf("/proc file truncated at %d bytes\n", length);
+            break;
+        }
+        int size = proc_buffer_size - 1 - length;
+        ret = pread(fd, proc_buffer + length, size, length);
+        if (ret <= 0) {
+            break;
+        }
+        length += ret;
+        if (!paged && ret < size) {
+            break; // short read, at the end of the file
+        }
+    }
+    if (length == 0) {
+        return -1;
+    }
+    proc_buffer[length] = '\0';
+    return length;
+}
+
+static int open_proc_file(int *fd, const char *path) {
+    if (*fd == -1) {
+        *fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (*fd == -1) {
+            printf("Couldn't open %s: %s\n", path, strerror(errno));
+        }
+    }
+    return *fd;
+}
+
+// Next unsigned number after *p, *p is moved behind it
+static unsigned long long scan_number(const char **p) {
+    const char *c = *p;
+    unsigned long long value = 0;
+    while (*c != '\0' && (*c < '0' || *c > '9')) {
+        c++;
+    }
+    while (*c >= '0' && *c <= '9') {
+        value = value * 10 + (*c++ - '0');
+    }
+    *p = c;
+    return value;
+}
+
+// Skip n space separated fields
+static const char *skip_fields(const char *p, int n) {
+    for (int i = 0; i < n; i++) {
+        while (*p == ' ') {
+            p++;
+        }
+        while (*p != ' ' && *p != '\n' && *p != '\0') {
+            p++;
+        }
+    }
+    return p;
+}
+
+// Number following key, e.g. "syscr:" in /proc/pid/io
+static unsigned long long find_value(const char *buffer, const char *key) {
+    const char *p = strstr(buffer, key);
+    if (p == NULL) {
+        return 0;
+    }
+    p += strlen(key);
+    return scan_number(&p);
+}
 
 int read_process_stats(struct proc_stats *p_info) {
     char path[64];
@@ -38,54 +128,41 @@ int read_process_stats(struct proc_stats *p_info) {
     long delta_rss = p_info->rss;
     long delta_io_op = p_info->io_op;
 
-    // Read /proc/pid/stat file for cpu time
-    snprintf(path, sizeof(path), "/proc/%d/stat", p_info->pid);
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
-        perror("Couldn't open /proc/pid/stat file");
-        return -1;
+    // Zero-initialised structs have no files open yet, 0 is never one of ours. -1 means gone (failed
+    // open or closed), never reopened as the pid may belong to another process by now
+    if (p_info->stat_fd == 0) {
+        snprintf(path, sizeof(path), "/proc/%d/stat", p_info->pid);
+        p_info->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (p_info->io_fd == 0) {
+        snprintf(path, sizeof(path), "/proc/%d/io", p_info->pid);
+        p_info->io_fd = open(path, O_RDONLY | O_CLOEXEC);
     }
-    unsigned long current_utime; // user cpu time in jiffies
-    unsigned long current_stime; // system cpu time in jiffies
-    char state;
-    // Parenthesis skip for name field, utime14, stime15, 
-    int ret = fscanf(fp, "%*d (%*[^)]) %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu ",
-            &state, &current_utime, &current_stime);
-    fclose(fp);
-    p_info->cputime = current_utime + current_stime;
 
-    // Read proc/pid/io file for I/O operations
-    snprintf(path, sizeof(path), "/proc/%d/io", p_info->pid);
-    fp = fopen(path, "r");
-    if (!fp) {
-        perror("Couldn't open /proc/pid/io file");
+    // /proc/pid/stat for cpu time and resident set size
+    if (p_info->stat_fd == -1 || read_proc_file(p_info->stat_fd, 0) == -1) {
+        perror("Couldn't read /proc/pid/stat file");
         return -1;
     }
-    unsigned long long io_read, io_write;
-    unsigned long syscr, syscw;
-    fscanf(fp, "rchar: %llu\n", &io_read);
-    fscanf(fp, "wchar: %llu\n", &io_write);
-    fscanf(fp, "syscr: %lu\n", &syscr);
-    fscanf(fp, "syscw: %lu\n", &syscw);
-    unsigned long io_operations = syscr + syscw;
-    p_info->io_op = io_operations;
-    fclose(fp);
-
-    // Read proc/pid/status file for resident set size
-    snprintf(path, sizeof(path), "/proc/%d/status", p_info->pid);
-    fp = fopen(path, "r");
-    if (!fp) {
-        perror("Couldn't open /proc/pid/status file");
+    // Name field may contain spaces and parentheses, fields continue after the last ')'
+    const char *p = strrchr(proc_buffer, ')');
+    if (p == NULL) {
         return -1;
     }
-    char line[256];
-    while (fgets(line, sizeof(line), fp)) { // read line by line
-        if (strncmp(line, "VmRSS:", 6) == 0) { // break when right line found
-            sscanf(line + 6, "%lu", &p_info->rss);
-            break;
-        }
+    p = skip_fields(p + 1, 11); // state3 ... cmajflt13
+    unsigned long current_utime = scan_number(&p); // user cpu time in jiffies, field 14
+    unsigned long current_stime = scan_number(&p); // system cpu time in jiffies, field 15
+    p = skip_fields(p, 8); // cutime16 ... vsize23
+    long rss_pages = scan_number(&p); // field 24
+    p_info->cputime = current_utime + current_stime;
+    p_info->rss = rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+    // /proc/pid/io for I/O operations
+    if (p_info->io_fd == -1 || read_proc_file(p_info->io_fd, 0) == -1) {
+        perror("Couldn't read /proc/pid/io file");
+        return -1;
     }
-    fclose(fp);
+    p_info->io_op = find_value(proc_buffer, "syscr:") + find_value(proc_buffer, "syscw:");
 
     // If just created, skip
     if (p_info->rss == 0) {
@@ -99,75 +176,217 @@ int read_process_stats(struct proc_stats *p_info) {
     return 0;
 }
 
+// Current resident set size from /proc/pid/statm and the I/O of all threads from /proc/pid/io,
+// what taskstats has no exact value for. Interval values are left to the caller.
+int read_process_rss_io(struct proc_stats *p_info) {
+    char path[64];
+    if (p_info->statm_fd == 0) {
+        snprintf(path, sizeof(path), "/proc/%d/statm", p_info->pid);
+        p_info->statm_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (p_info->io_fd == 0) {
+        snprintf(path, sizeof(path), "/proc/%d/io", p_info->pid);
+        p_info->io_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    // size resident shared text lib data dt, in pages
+    if (p_info->statm_fd == -1 || read_proc_file(p_info->statm_fd, 0) == -1) {
+        perror("Couldn't read /proc/pid/statm file");
+        return -1;
+    }
+    const char *p = skip_fields(proc_buffer, 1);
+    p_info->rss = scan_number(&p) * (sysconf(_SC_PAGESIZE) / 1024);
+
+    if (p_info->io_fd == -1 || read_proc_file(p_info->io_fd, 0) == -1) {
+        perror("Couldn't read /proc/pid/io file");
+        return -1;
+    }
+    p_info->io_op = find_value(proc_buffer, "syscr:") + find_value(proc_buffer, "syscw:");
+    return 0;
+}
+
+// Proportional set size in kB, shared pages split between the processes mapping them
+long read_process_pss(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int length = read_proc_file(fd, 0);
+    close(fd);
+    if (length == -1 || strstr(proc_buffer, "Pss:") == NULL) {
+        return -1;
+    }
+    return find_value(proc_buffer, "Pss:");
+}
+
+void close_process_stats(struct proc_stats *p_info) {
+    if (p_info->stat_fd > 0) {
+        close(p_info->stat_fd);
+    }
+    if (p_info->io_fd > 0) {
+        close(p_info->io_fd);
+    }
+    if (p_info->statm_fd > 0) {
+        close(p_info->statm_fd);
+    }
+    p_info->stat_fd = -1;
+    p_info->io_fd = -1;
+    p_info->statm_fd = -1;
+}
+
+// Number of lines in the held-open file, sizes the device array
+static int count_lines(int fd) {
+    int lines = 0;
+    if (read_proc_file(fd, 1) == -1) {
+        return 0;
+    }
+    for (const char *p = proc_buffer; (p = strchr(p, '\n')) != NULL; p++) {
+        lines++;
+    }
+    return lines;
+}
+
+// Per-cpu and per-device arrays, sized once on the first read
+static int alloc_system_arrays(struct system_stats *sys_stats) {
+    sys_stats->num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    sys_stats->max_disks = count_lines(diskstats_fd) + DISKS_HOTPLUG;
+    sys_stats->num_disks = 0;
+    sys_stats->cpus = calloc(sys_stats->num_cpus, sizeof(struct cpu_stats));
+    sys_stats->disks = calloc(sys_stats->max_disks, sizeof(struct disk_stats));
+    if (sys_stats->cpus == NULL || sys_stats->disks == NULL) {
+        printf("System statistics allocation failed.\n");
+        free_systemwide_stats(sys_stats);
+        return -1;
+    }
+    return 0;
+}
+
+// Slot of the device, devices keep their order in /proc/diskstats so it is usually the hint
+static struct disk_stats *find_disk(struct system_stats *sys_stats, int hint, const char *name, int length) {
+    if (length >= (int) sizeof(sys_stats->disks[0].name)) {
+        length = sizeof(sys_stats->disks[0].name) - 1;
+    }
+    for (int i = 0; i < sys_stats->num_disks; i++) {
+        struct disk_stats *disk = &sys_stats->disks[(hint + i) % sys_stats->num_disks];
+        if (strncmp(disk->name, name, length) == 0 && disk->name[length] == '\0') {
+            return disk;
+        }
+    }
+    if (sys_stats->num_disks == sys_stats->max_disks) {
+        return NULL; // only counted in the total
+    }
+    struct disk_stats *disk = &sys_stats->disks[sys_stats->num_disks++];
+    memset(disk, 0, sizeof(struct disk_stats));
+    memcpy(disk->name, name, length);
+    disk->name[length] = '\0';
+    return disk;
+}
+
 int read_systemwide_stats(struct system_stats *sys_stats) {
     // Save previous values for energy estimation
     unsigned long delta_cputime = sys_stats->cputime; 
     long delta_rss = sys_stats->rss;
     long delta_io_op = sys_stats->io_op;
 
-    // Read /proc/stat file for systemwide cpu time
-    char line[256];
-    FILE *fp = fopen("/proc/stat", "r");
-    if (!fp) {
-        perror("Couldn't open /proc/stat file");
+    if (open_proc_file(&stat_fd, "/proc/stat") == -1 || open_proc_file(&meminfo_fd, "/proc/meminfo") == -1
+            || open_proc_file(&diskstats_fd, "/proc/diskstats") == -1) {
         return -1;
     }
-    // Add up all besides idle
-    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice; // in jiffies
-    unsigned long long total_cpu_time = 0; // in jiffies
-
-    while (fgets(line, sizeof(line), fp)) {
-        if (strncmp(line, "cpu ", 4) != 0) { // should be first line
-            continue;
-        }
-        sscanf(line, "cpu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu", 
-            &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal, &guest, &guest_nice);
-        total_cpu_time = user + nice + system + iowait + irq + softirq + steal + guest + guest_nice;
-        break;
+    if (sys_stats->cpus == NULL && alloc_system_arrays(sys_stats) == -1) {
+        return -1;
     }
-    fclose(fp);
-    sys_stats->cputime = total_cpu_time;
 
-    // Read /proc/meminfo file for systemwide memory usage
-    fp = fopen("/proc/meminfo", "r");
-    if (!fp) {
-        perror("Couldn't open /proc/meminfo file");
+    // /proc/stat for cpu time, "cpu " (all cpus) is the first line, followed by one "cpuN" per cpu
+    if (read_proc_file(stat_fd, 0) == -1) {
         return -1;
     }
-
-    unsigned long mem_total, mem_free; // in kB
-    while (fgets(line, sizeof(line), fp)) {
-        if (strncmp(line, "MemTotal:", 9) == 0) {
-            sscanf(line, "MemTotal: %ld kB", &mem_total);
-        } else if (strncmp(line, "MemFree:", 8) == 0) {
-            sscanf(line, "MemFree: %ld kB", &mem_free);
+    const char *p = proc_buffer;
+    while (strncmp(p, "cpu", 3) == 0) {
+        int cpu = -1;
+        p += 3;
+        if (*p != ' ') {
+            cpu = scan_number(&p);
+        }
+        // Add up all besides idle (4th value)
+        unsigned long long busy = 0, idle = 0; // in jiffies
+        for (int i = 0; i < 10; i++) {
+            unsigned long long value = scan_number(&p);
+            if (i != 3) {
+                busy += value;
+            } else {
+                idle = value;
+            }
+        }
+        if (cpu == -1) {
+            sys_stats->cputime = busy;
+        } else if (cpu < sys_stats->num_cpus) {
+            struct cpu_stats *cpu_stats = &sys_stats->cpus[cpu];
+            // intervals start with the second read, like the totals
+            if (delta_cputime != 0) {
+                cpu_stats->busy_interval = busy - cpu_stats->busy;
+                cpu_stats->idle_interval = idle - cpu_stats->idle;
+            }
+            cpu_stats->busy = busy;
+            cpu_stats->idle = idle;
+        }
+        p = strchr(p, '\n');
+        if (p == NULL) {
+            break;
         }
+        p++;
     }
-    fclose(fp);
-    sys_stats->rss = mem_total - mem_free;
 
-    // Read /proc/diskstats file for systemwide I/O operations
-    fp = fopen("/proc/diskstats", "r");
-    if (!fp) {
-        perror("Couldn't open /proc/diskstats file");
+    // /proc/meminfo for systemwide memory usage, both fields are on the first lines
+    if (read_proc_file(meminfo_fd, 0) == -1) {
         return -1;
     }
+    unsigned long mem_total = find_value(proc_buffer, "MemTotal:"); // in kB
+    unsigned long mem_free = find_value(proc_buffer, "MemFree:");
+    sys_stats->rss = mem_total - mem_free;
 
+    // /proc/diskstats for I/O operations, in total and per device
+    if (read_proc_file(diskstats_fd, 1) == -1) {
+        return -1;
+    }
     unsigned long read_op = 0, write_op = 0;
-    char device_name[32];
-    while (fgets(line, sizeof(line), fp)) {
-        unsigned long read = 0, write = 0;
-        sscanf(line, "%*u %*u %s %lu %*u %*u %*u %lu", 
-            device_name, &read, &write);
+    int line = 0;
+    p = proc_buffer;
+    while (*p != '\0') {
+        const char *device_name = skip_fields(p, 2);
+        while (*device_name == ' ') {
+            device_name++;
+        }
         // Skip loop device names virtual not actual io?
-        if (strncmp(device_name, "loop", 4) == 0){
-                    continue;
+        if (strncmp(device_name, "loop", 4) != 0) {
+            p = skip_fields(device_name, 1);
+            struct disk_stats *disk = find_disk(sys_stats, line, device_name, p - device_name);
+            unsigned long reads = scan_number(&p); // reads completed, field 4
+            p = skip_fields(p, 3);
+            unsigned long writes = scan_number(&p); // writes completed, field 8
+            p = skip_fields(p, 4);
+            unsigned long io_ticks = scan_number(&p); // ms spent doing I/O, field 13
+            read_op += reads;
+            write_op += writes;
+            if (disk != NULL) {
+                if (delta_cputime != 0) {
+                    disk->reads_interval = reads - disk->reads;
+                    disk->writes_interval = writes - disk->writes;
+                    disk->io_ticks_interval = io_ticks - disk->io_ticks;
+                }
+                disk->reads = reads;
+                disk->writes = writes;
+                disk->io_ticks = io_ticks;
+            }
+            line++;
         }
-
-        read_op += read;
-        write_op += write;
+        p = strchr(p, '\n');
+        if (p == NULL) {
+            break;
+        }
+        p++;
     }
-    fclose(fp);
     sys_stats->io_op = read_op + write_op;
 
     // Compute interval statistics
@@ -179,6 +398,23 @@ int read_systemwide_stats(struct system_stats *sys_stats) {
     return 0;
 }
 
+// Busy jiffies of the interval summed per package, e.g. to split socket energy
+void cpu_busy_packages(struct system_stats *sys_stats, unsigned long long *busy_package) {
+    memset(busy_package, 0, sizeof(unsigned long long) * RAPL_MAX_PACKAGES);
+    for (int i = 0; i < sys_stats->num_cpus; i++) {
+        busy_package[cpu_to_package(i)] += sys_stats->cpus[i].busy_interval;
+    }
+}
+
+void free_systemwide_stats(struct system_stats *sys_stats) {
+    free(sys_stats->cpus);
+    free(sys_stats->disks);
+    sys_stats->cpus = NULL;
+    sys_stats->disks = NULL;
+    sys_stats->num_cpus = 0;
+    sys_stats->num_disks = 0;
+}
+
 int check_zombie_state(pid_t pid) {
     char stat_path[64];
     char state;
@@ -196,3 +432,33 @@ int check_zombie_state(pid_t pid) {
     }
     return 0;
 }
+
+/* testing, cost per call, 10000 reads of the system-wide files and of our own /proc/pid files
+#include <stdlib.h>
+#include <time.h>
+int main() {
+    struct system_stats sys_stats;
+    struct proc_stats p_stats;
+    struct timespec start, end;
+    memset(&sys_stats, 0, sizeof(sys_stats));
+    memset(&p_stats, 0, sizeof(p_stats));
+    p_stats.pid = getpid();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 10000; i++) {
+        read_systemwide_stats(&sys_stats);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("read_systemwide_stats: %.2f us\n",
+        ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3 / 10000);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 10000; i++) {
+        read_process_stats(&p_stats);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("read_process_stats: %.2f us\n",
+        ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3 / 10000);
+    close_process_stats(&p_stats);
+}
+// */
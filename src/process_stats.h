@@ -1,21 +1,58 @@
 #ifndef process_stats_h
 #define process_stats_h
 
+#include "thread_stats.h"
+
+#define DISKS_HOTPLUG 8 // devices that may appear after the first read
+
 struct proc_stats 
 { 
     pid_t pid;
+    pid_t parent; // monitored process whose inherited counters include it, 0 if it has its own
+    int exited; // final counters read, removed after the interval
     unsigned long cputime; // in jiffies, divide by sysconf(_SC_CLK_TCK) for seconds
     long rss; // in kB
     long io_op; 
     unsigned long cputime_interval; // in jiffies
     long rss_interval; // in kB
     long io_op_interval;
-    long long cycles_interval;
+    long long cycles_interval; // scaled if the counter was multiplexed
+    double multiplex_ratio; // time_running / time_enabled of the cycles counter
     int fd;
-    long long energy_interval_est; // in microjoules
+    int llc_fd; // LLC misses, memory traffic for the DRAM share
+    long long llc_misses_interval; // -1 if not counted
+    long pss; // in kB from smaps_rollup, -1 unless read
+    int stat_fd; // /proc/pid/stat and /proc/pid/io, held open between reads
+    int io_fd;
+    int statm_fd; // /proc/pid/statm, only with taskstats
+    int *thread_fds; // inherited counters of the threads that existed at attach
+    int num_thread_fds;
+    struct thread_table *threads; // per-thread breakdown, NULL unless enabled
+    long long energy_interval_est; // package share, in microjoules
+    long long energy_dram_interval_est; // DRAM share, in microjoules
+    long long energy_total_est; // package and DRAM since monitoring started, in microjoules
 };
 
 
+struct cpu_stats
+{
+    unsigned long long busy; // in jiffies, all but idle like system_stats.cputime
+    unsigned long long idle;
+    unsigned long long busy_interval;
+    unsigned long long idle_interval;
+};
+
+struct disk_stats
+{
+    char name[32];
+    unsigned long reads; // completed
+    unsigned long writes;
+    unsigned long io_ticks; // in ms with I/O in flight, equals the interval when saturated
+    unsigned long reads_interval;
+    unsigned long writes_interval;
+    unsigned long io_ticks_interval;
+};
+
 struct system_stats 
 {
     unsigned long cputime; // in jiffies, divide by sysconf(_SC_CLK_TCK) for seconds
@@ -25,12 +62,30 @@ struct system_stats
     long rss_interval; // in kB
     long io_op_interval;
     long long cycles;
+    long long instructions;
+    long long llc_misses;
+    double multiplex_ratio; // lowest time_running / time_enabled of the interval's counters
+    struct cpu_stats *cpus; // indexed by cpu, allocated by the first read
+    int num_cpus;
+    struct disk_stats *disks; // block devices except loop, allocated by the first read
+    int num_disks;
+    int max_disks;
 };
 
 int read_process_stats(struct proc_stats *p_info);
 
+int read_process_rss_io(struct proc_stats *p_info);
+
+void close_process_stats(struct proc_stats *p_info);
+
+long read_process_pss(pid_t pid);
+
 int read_systemwide_stats(struct system_stats *sys_stats);
 
+void cpu_busy_packages(struct system_stats *sys_stats, unsigned long long *busy_package);
+
+void free_systemwide_stats(struct system_stats *sys_stats);
+
 int check_zombie_state(pid_t pid);
 
 #endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "process_stats.h"
+#include "process_table.h"
+
+/* ///////////////////////////////////////////
+   Every process of the host in one table: entries live in a dense
+   proc_stats array (removal moves the last entry into the gap), and an
+   open addressing table maps (pid, starttime) to their index. The start
+   time from /proc/pid/stat tells a reused pid apart from the process
+   that had it before, so no deltas are carried over. Slots are hashed
+   by pid only, which also allows lookups by pid for perf samples and
+   netlink events. Entries come and go with scan_process_table or with
+   add/remove calls from proc connector events.
+*/ ///////////////////////////////////////////
+
+static unsigned int hash_pid(pid_t pid) {
+    return (unsigned int) pid * 2654435761u;
+}
+
+static int grow_slots(struct process_table *table) {
+    int size = table->slots_size == 0 ? 1024 : table->slots_size * 2;
+    int *resized = calloc(size, sizeof(int));
+    if (resized == NULL) {
+        printf("Process table allocation failed.\n");
+        return -1;
+    }
+    for (int i = 0; i < table->num; i++) {
+        unsigned int slot = hash_pid(table->entries[i].pid) & (size - 1);
+        while (resized[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        resized[slot] = i + 1;
+    }
+    free(table->slots);
+    table->slots = resized;
+    table->slots_size = size;
+    return 0;
+}
+
+// Slot of the key, or of the empty slot it would go into
+static unsigned int find_slot(struct process_table *table, pid_t pid, unsigned long long starttime) {
+    unsigned int slot = hash_pid(pid) & (table->slots_size - 1);
+    while (table->slots[slot] != 0) {
+        int i = table->slots[slot] - 1;
+        if (table->entries[i].pid == pid && table->starttimes[i] == starttime) {
+            break;
+        }
+        slot = (slot + 1) & (table->slots_size - 1);
+    }
+    return slot;
+}
+
+// Empty a slot, later entries of the probe sequence move up so no lookup stops early
+static void delete_slot(struct process_table *table, unsigned int slot) {
+    unsigned int mask = table->slots_size - 1;
+    unsigned int hole = slot;
+    for (unsigned int next = (slot + 1) & mask; table->slots[next] != 0; next = (next + 1) & mask) {
+        unsigned int home = hash_pid(table->entries[table->slots[next] - 1].pid) & mask;
+        // movable if the hole lies between its home slot and where it is now
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->slots[hole] = table->slots[next];
+            hole = next;
+        }
+    }
+    table->slots[hole] = 0;
+}
+
+struct process_table *init_process_table() {
+    struct process_table *table = calloc(1, sizeof(struct process_table));
+    if (table == NULL || grow_slots(table) == -1) {
+        printf("Process table allocation failed.\n");
+        free(table);
+        return NULL;
+    }
+    // Without taskstats every process holds its /proc files open, more than the default 1024 fds
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return table;
+}
+
+// Field 22 of /proc/pid/stat, in clock ticks since boot
+int read_process_starttime(pid_t pid, unsigned long long *starttime) {
+    char path[64];
+    char buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    // Name field may contain spaces and parentheses, fields continue after the last ')'
+    char *fields = strrchr(buffer, ')');
+    if (fields == NULL || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d "
+            "%*d %*d %llu", starttime) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Entry of a running process, an entry of an earlier process with the same pid is replaced
+struct proc_stats *add_process_entry(struct process_table *table, pid_t pid) {
+    unsigned long long starttime;
+    if (read_process_starttime(pid, &starttime) == -1) {
+        return NULL; // gone already
+    }
+    // keep the load below 70%
+    if (table->num * 10 >= table->slots_size * 7 && grow_slots(table) == -1) {
+        return NULL;
+    }
+    unsigned int slot = find_slot(table, pid, starttime);
+    if (table->slots[slot] != 0) {
+        table->seen[table->slots[slot] - 1] = table->generation;
+        return &table->entries[table->slots[slot] - 1];
+    }
+    struct proc_stats *reused = find_process_pid(table, pid);
+    if (reused != NULL) {
+        remove_process_entry(table, reused);
+        slot = find_slot(table, pid, starttime);
+    }
+
+    if (table->num == table->size) {
+        int size = table->size == 0 ? 1024 : table->size * 2;
+        struct proc_stats *entries = realloc(table->entries, sizeof(struct proc_stats) * size);
+        if (entries == NULL) {
+            printf("Process table allocation failed.\n");
+            return NULL;
+        }
+        table->entries = entries;
+        unsigned long long *starttimes = realloc(table->starttimes, sizeof(unsigned long long) * size);
+        if (starttimes == NULL) {
+            printf("Process table allocation failed.\n");
+            return NULL;
+        }
+        table->starttimes = starttimes;
+        unsigned int *seen = realloc(table->seen, sizeof(unsigned int) * size);
+        if (seen == NULL) {
+            printf("Process table allocation failed.\n");
+            return NULL;
+        }
+        table->seen = seen;
+        table->size = size;
+    }
+    struct proc_stats *p_stats = &table->entries[table->num];
+    memset(p_stats, 0, sizeof(struct proc_stats));
+    p_stats->pid = pid;
+    p_stats->fd = -1; // no counters unless the caller opens them
+    p_stats->llc_fd = -1;
+    p_stats->llc_misses_interval = -1;
+    p_stats->pss = -1;
+    p_stats->multiplex_ratio = 1.0;
+    table->starttimes[table->num] = starttime;
+    table->seen[table->num] = table->generation;
+    table->slots[slot] = ++table->num;
+    return p_stats;
+}
+
+// Entry with the pid, whatever its start time
+struct proc_stats *find_process_pid(struct process_table *table, pid_t pid) {
+    unsigned int slot = hash_pid(pid) & (table->slots_size - 1);
+    while (table->slots[slot] != 0) {
+        if (table->entries[table->slots[slot] - 1].pid == pid) {
+            return &table->entries[table->slots[slot] - 1];
+        }
+        slot = (slot + 1) & (table->slots_size - 1);
+    }
+    return NULL;
+}
+
+// Closes the held /proc files, the last entry moves into the freed index
+void remove_process_entry(struct process_table *table, struct proc_stats *p_stats) {
+    int i = p_stats - table->entries;
+    int last = table->num - 1;
+    close_process_stats(p_stats);
+    delete_slot(table, find_slot(table, p_stats->pid, table->starttimes[i]));
+    if (i != last) {
+        unsigned int slot = find_slot(table, table->entries[last].pid, table->starttimes[last]);
+        table->entries[i] = table->entries[last];
+        table->starttimes[i] = table->starttimes[last];
+        table->seen[i] = table->seen[last];
+        table->slots[slot] = i + 1;
+    }
+    table->num--;
+}
+
+// Walk /proc, add new processes and remove the ones that are gone, returns the number of processes
+int scan_process_table(struct process_table *table) {
+    DIR *dir = opendir("/proc");
+    if (dir == NULL) {
+        perror("Couldn't open /proc");
+        return -1;
+    }
+    table->generation++;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        pid_t pid = atoi(entry->d_name);
+        if (pid > 0) {
+            add_process_entry(table, pid);
+        }
+    }
+    closedir(dir);
+    for (int i = 0; i < table->num; i++) {
+        if (table->seen[i] != table->generation) {
+            remove_process_entry(table, &table->entries[i]);
+            i--; // last entry moved here
+        }
+    }
+    return table->num;
+}
+
+static void sift_down(struct process_table *table, int *heap, int num, int i) {
+    while (2 * i + 1 < num) {
+        int child = 2 * i + 1;
+        if (child + 1 < num && table->entries[heap[child + 1]].energy_interval_est
+                < table->entries[heap[child]].energy_interval_est) {
+            child++;
+        }
+        if (table->entries[heap[i]].energy_interval_est <= table->entries[heap[child]].energy_interval_est) {
+            return;
+        }
+        int swap = heap[i];
+        heap[i] = heap[child];
+        heap[child] = swap;
+        i = child;
+    }
+}
+
+// Indices of the k entries with the most estimated energy, most first, returns how many were found
+int top_process_entries(struct process_table *table, int *indices, int k) {
+    int num = 0;
+    // min-heap of the k largest seen so far, root is the smallest of them
+    for (int i = 0; i < table->num && k > 0; i++) {
+        if (num < k) {
+            indices[num++] = i;
+            for (int j = num / 2 - 1; num == k && j >= 0; j--) {
+                sift_down(table, indices, num, j);
+            }
+        } else if (table->entries[i].energy_interval_est > table->entries[indices[0]].energy_interval_est) {
+            indices[0] = i;
+            sift_down(table, indices, num, 0);
+        }
+    }
+    if (num < k) {
+        for (int j = num / 2 - 1; j >= 0; j--) {
+            sift_down(table, indices, num, j);
+        }
+    }
+    // Pop the smallest to the back
+    for (int end = num - 1; end > 0; end--) {
+        int swap = indices[0];
+        indices[0] = indices[end];
+        indices[end] = swap;
+        sift_down(table, indices, end, 0);
+    }
+    return num;
+}
+
+void free_process_table(struct process_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    for (int i = 0; i < table->num; i++) {
+        close_process_stats(&table->entries[i]);
+    }
+    free(table->entries);
+    free(table->starttimes);
+    free(table->seen);
+    free(table->slots);
+    free(table);
+}
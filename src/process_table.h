@@ -0,0 +1,36 @@
+#ifndef process_table_h
+#define process_table_h
+
+#include <sys/types.h>
+#include "process_stats.h"
+
+// Dense array of processes, (pid, starttime) -> index + 1 in an open addressing table
+struct process_table
+{
+    struct proc_stats *entries; // contiguous, usable with read_process_stats_batch
+    unsigned long long *starttimes; // in clock ticks since boot, tells a reused pid apart
+    unsigned int *seen; // scan generation an entry was last found in
+    int num;
+    int size;
+    int *slots;
+    int slots_size; // power of two
+    unsigned int generation;
+};
+
+struct process_table *init_process_table();
+
+int read_process_starttime(pid_t pid, unsigned long long *starttime);
+
+struct proc_stats *add_process_entry(struct process_table *table, pid_t pid);
+
+struct proc_stats *find_process_pid(struct process_table *table, pid_t pid);
+
+void remove_process_entry(struct process_table *table, struct proc_stats *p_stats);
+
+int scan_process_table(struct process_table *table);
+
+int top_process_entries(struct process_table *table, int *indices, int k);
+
+void free_process_table(struct process_table *table);
+
+#endif
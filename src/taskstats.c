@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+#include "process_stats.h"
+#include "taskstats.h"
+
+/* ///////////////////////////////////////////
+   Process cpu time over the TASKSTATS generic netlink family, a
+   TASKSTATS_CMD_GET by tgid per process sums the cpu time (us) of the
+   live threads. Threads that exited drop out of that sum, so the value
+   is kept monotonic and such an interval counts no more than what the
+   remaining threads add. The extended accounting is per task and
+   rounded (syscalls to multiples of 1024, RSS only as high-water mark),
+   so current RSS and I/O of all threads still come from /proc/pid/statm
+   and /proc/pid/io, held open. Requests are sent in batches over one
+   socket and matched by sequence number. Without the family (e.g. in a
+   network namespace), the /proc parser of process_stats.c is used.
+   With the statm and io reads left, a warm pass costs about the same as
+   the /proc path (1k pids ~5 ms each, 10k pids 55-60 vs 65-90 ms), so
+   it is only used with -n.
+*/ ///////////////////////////////////////////
+
+#define GENL_BUFFER 32768
+
+static int nl_fd = -1;
+static int family_id = 0;
+static unsigned int sequence = 0;
+
+// Append an attribute to the message
+static void add_attribute(struct nlmsghdr *nl_header, int type, const void *data, int length) {
+    struct nlattr *attribute = (struct nlattr *) ((char *) nl_header + NLMSG_ALIGN(nl_header->nlmsg_len));
+    attribute->nla_type = type;
+    attribute->nla_len = NLA_HDRLEN + length;
+    memcpy((char *) attribute + NLA_HDRLEN, data, length);
+    nl_header->nlmsg_len = NLMSG_ALIGN(nl_header->nlmsg_len) + NLA_ALIGN(attribute->nla_len);
+}
+
+// Generic netlink header of a request, attributes are appended with add_attribute
+static struct nlmsghdr *begin_message(char *buffer, int type, int command, unsigned int seq) {
+    struct nlmsghdr *nl_header = (struct nlmsghdr *) buffer;
+    memset(buffer, 0, NLMSG_SPACE(GENL_HDRLEN));
+    nl_header->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    nl_header->nlmsg_type = type;
+    nl_header->nlmsg_flags = NLM_F_REQUEST;
+    nl_header->nlmsg_seq = seq;
+    nl_header->nlmsg_pid = 0;
+    struct genlmsghdr *genl_header = NLMSG_DATA(nl_header);
+    genl_header->cmd = command;
+    genl_header->version = 1;
+    return nl_header;
+}
+
+// Attributes of a generic netlink message
+static struct nlattr *first_attribute(struct nlmsghdr *nl_header, int *remaining) {
+    *remaining = nl_header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    return (struct nlattr *) ((char *) NLMSG_DATA(nl_header) + GENL_HDRLEN);
+}
+
+static struct nlattr *next_attribute(struct nlattr *attribute, int *remaining) {
+    *remaining -= NLA_ALIGN(attribute->nla_len);
+    return (struct nlattr *) ((char *) attribute + NLA_ALIGN(attribute->nla_len));
+}
+
+static int attribute_ok(struct nlattr *attribute, int remaining) {
+    return remaining >= (int) NLA_HDRLEN && attribute->nla_len >= NLA_HDRLEN
+        && attribute->nla_len <= remaining;
+}
+
+static int resolve_family() {
+    char buffer[GENL_BUFFER] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nl_header = begin_message(buffer, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, ++sequence);
+    add_attribute(nl_header, CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME, strlen(TASKSTATS_GENL_NAME) + 1);
+    if (send(nl_fd, buffer, nl_header->nlmsg_len, 0) == -1) {
+        return -1;
+    }
+    int length = recv(nl_fd, buffer, sizeof(buffer), 0);
+    if (length <= 0 || !NLMSG_OK(nl_header, length) || nl_header->nlmsg_type == NLMSG_ERROR) {
+        return -1;
+    }
+    int remaining;
+    for (struct nlattr *attribute = first_attribute(nl_header, &remaining); attribute_ok(attribute, remaining);
+            attribute = next_attribute(attribute, &remaining)) {
+        if (attribute->nla_type == CTRL_ATTR_FAMILY_ID) {
+            family_id = *(unsigned short *) ((char *) attribute + NLA_HDRLEN);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int init_taskstats() {
+    nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (nl_fd == -1) {
+        perror("Couldn't open generic netlink socket");
+        return -1;
+    }
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    if (bind(nl_fd, (struct sockaddr *) &address, sizeof(address)) == -1 || resolve_family() == -1) {
+        printf("No taskstats, reading /proc instead\n");
+        close_taskstats();
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the struct taskstats out of a TASKSTATS_TYPE_AGGR_TGID or _PID reply
+static int parse_reply(struct nlmsghdr *nl_header, struct taskstats *stats) {
+    int remaining;
+    for (struct nlattr *attribute = first_attribute(nl_header, &remaining); attribute_ok(attribute, remaining);
+            attribute = next_attribute(attribute, &remaining)) {
+        if (attribute->nla_type != TASKSTATS_TYPE_AGGR_TGID && attribute->nla_type != TASKSTATS_TYPE_AGGR_PID) {
+            continue;
+        }
+        int nested_remaining = attribute->nla_len - NLA_HDRLEN;
+        struct nlattr *nested = (struct nlattr *) ((char *) attribute + NLA_HDRLEN);
+        for (; attribute_ok(nested, nested_remaining); nested = next_attribute(nested, &nested_remaining)) {
+            if (nested->nla_type == TASKSTATS_TYPE_STATS) {
+                // older kernels send a shorter struct
+                int size = nested->nla_len - NLA_HDRLEN;
+                memset(stats, 0, sizeof(struct taskstats));
+                memcpy(stats, (char *) nested + NLA_HDRLEN, size < (int) sizeof(struct taskstats)
+                        ? size : (int) sizeof(struct taskstats));
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// -1 if the /proc files of the process can not be read anymore
+static int apply_taskstats(struct proc_stats *p_info, struct taskstats *tgid_stats) {
+    // Save previous values for energy estimation
+    unsigned long delta_cputime = p_info->cputime;
+    long delta_rss = p_info->rss;
+    long delta_io_op = p_info->io_op;
+
+    // in jiffies, a thread that exited takes its cpu time out of the sum
+    unsigned long cputime = (tgid_stats->ac_utime + tgid_stats->ac_stime) * sysconf(_SC_CLK_TCK) / 1000000;
+    p_info->cputime = cputime > delta_cputime ? cputime : delta_cputime;
+    if (read_process_rss_io(p_info) == -1) {
+        return -1;
+    }
+
+    // If just created, skip
+    if (p_info->rss == 0) {
+        return 0;
+    }
+    p_info->cputime_interval = p_info->cputime - delta_cputime;
+    p_info->rss_interval = p_info->rss - delta_rss;
+    p_info->io_op_interval = p_info->io_op - delta_io_op;
+    return 0;
+}
+
+// One batch: all requests in one send, replies matched by sequence number
+static int read_batch(struct proc_stats **processes, int num_processes, int **ret) {
+    char request[TASKSTATS_BATCH * NLMSG_SPACE(GENL_HDRLEN + NLA_HDRLEN + sizeof(unsigned int))]
+        __attribute__((aligned(NLMSG_ALIGNTO))) = {0};
+    char buffer[GENL_BUFFER] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct taskstats stats[TASKSTATS_BATCH];
+    int received[TASKSTATS_BATCH] = {0};
+    int length = 0;
+    unsigned int first_sequence = sequence + 1;
+
+    for (int i = 0; i < num_processes; i++) {
+        struct nlmsghdr *nl_header = begin_message(request + length, family_id, TASKSTATS_CMD_GET, ++sequence);
+        unsigned int id = processes[i]->pid;
+        add_attribute(nl_header, TASKSTATS_CMD_ATTR_TGID, &id, sizeof(id));
+        length += NLMSG_ALIGN(nl_header->nlmsg_len);
+    }
+    if (send(nl_fd, request, length, 0) == -1) {
+        perror("Couldn't send taskstats requests");
+        return -1;
+    }
+
+    int replies = 0;
+    while (replies < num_processes) {
+        length = recv(nl_fd, buffer, sizeof(buffer), 0);
+        if (length <= 0) {
+            return -1;
+        }
+        struct nlmsghdr *nl_header = (struct nlmsghdr *) buffer;
+        for (; NLMSG_OK(nl_header, length); nl_header = NLMSG_NEXT(nl_header, length)) {
+            unsigned int i = nl_header->nlmsg_seq - first_sequence;
+            if (i >= (unsigned int) num_processes) {
+                continue; // stale reply of an earlier batch
+            }
+            replies++;
+            // NLMSG_ERROR for processes that are gone
+            if (nl_header->nlmsg_type == family_id && parse_reply(nl_header, &stats[i]) == 0) {
+                received[i] = 1;
+            }
+        }
+    }
+    for (int i = 0; i < num_processes; i++) {
+        *ret[i] = received[i] ? apply_taskstats(processes[i], &stats[i]) : -1;
+    }
+    return 0;
+}
+
+// Like read_process_stats for every process, ret[i] is -1 where the process is gone.
+// Exited processes keep their final values and are skipped.
+int read_process_stats_batch(struct proc_stats *processes, int num_processes, int *ret) {
+    struct proc_stats *batch[TASKSTATS_BATCH];
+    int *batch_ret[TASKSTATS_BATCH];
+    int batch_size = 0;
+
+    for (int i = 0; i < num_processes; i++) {
+        ret[i] = 0;
+        if (processes[i].exited) {
+            continue;
+        }
+        if (nl_fd == -1) {
+            ret[i] = read_process_stats(&processes[i]);
+            continue;
+        }
+        batch[batch_size] = &processes[i];
+        batch_ret[batch_size++] = &ret[i];
+        if (batch_size == TASKSTATS_BATCH) {
+            if (read_batch(batch, batch_size, batch_ret) == -1) {
+                return -1;
+            }
+            batch_size = 0;
+        }
+    }
+    if (batch_size > 0 && read_batch(batch, batch_size, batch_ret) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void close_taskstats() {
+    if (nl_fd != -1) {
+        close(nl_fd);
+        nl_fd = -1;
+    }
+}
+
+/* testing, compares /proc and taskstats for 1k, 3k and 10k sleeping children. Each path has its
+   own entries and one untimed pass first, so both read held-open files, then the mean of 5 passes.
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+static double pass_ms(struct proc_stats *processes, int n, int *ret, int batch) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < 5; r++) {
+        if (batch) {
+            read_process_stats_batch(processes, n, ret);
+        }
+        for (int i = 0; !batch && i < n; i++) {
+            ret[i] = read_process_stats(&processes[i]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6) / 5;
+}
+int main() {
+    int sizes[3] = {1000, 3000, 10000};
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    int ret_init = init_taskstats();
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        struct proc_stats *proc = calloc(n, sizeof(struct proc_stats));
+        struct proc_stats *netlink = calloc(n, sizeof(struct proc_stats));
+        int *ret = malloc(sizeof(int) * n);
+        for (int i = 0; i < n; i++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                pause();
+                _exit(0);
+            }
+            proc[i].pid = pid;
+            netlink[i].pid = pid;
+        }
+        pass_ms(proc, n, ret, 0);
+        printf("%d pids /proc: %.2f ms\n", n, pass_ms(proc, n, ret, 0));
+        if (ret_init == 0) {
+            read_process_stats_batch(netlink, n, ret);
+            printf("%d pids taskstats: %.2f ms\n", n, pass_ms(netlink, n, ret, 1));
+        }
+        for (int i = 0; i < n; i++) {
+            kill(proc[i].pid, SIGKILL);
+        }
+        while (wait(NULL) > 0);
+        for (int i = 0; i < n; i++) {
+            close_process_stats(&proc[i]);
+            close_process_stats(&netlink[i]);
+        }
+        free(proc);
+        free(netlink);
+        free(ret);
+    }
+    close_taskstats();
+}
+// */
@@ -0,0 +1,14 @@
+#ifndef taskstats_h
+#define taskstats_h
+
+#include "process_stats.h"
+
+#define TASKSTATS_BATCH 64 // requests sent with one send()
+
+int init_taskstats();
+
+int read_process_stats_batch(struct proc_stats *processes, int num_processes, int *ret);
+
+void close_taskstats();
+
+#endif
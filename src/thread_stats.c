@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/types.h>
+#include "perf_events.h"
+#include "thread_stats.h"
+
+/* ///////////////////////////////////////////
+   Threads of a monitored process: counters opened with inherit only
+   follow tasks created after the attach, so every thread that already
+   exists gets its own inherited counter once. The per-thread breakdown
+   reads /proc/pid/task/tid/schedstat (time on cpu in ns) and splits the
+   process cycles and energy by each thread's share of the runtime.
+*/ ///////////////////////////////////////////
+
+static int compare_tid(const void *a, const void *b) {
+    pid_t tid_a = ((const struct thread_stats *) a)->tid;
+    pid_t tid_b = ((const struct thread_stats *) b)->tid;
+    return (tid_a > tid_b) - (tid_a < tid_b);
+}
+
+// Inherited counters for the existing threads except the main thread, returns their number
+int open_thread_counters(pid_t pid, int **fds) {
+    char path[64];
+    int num_fds = 0;
+
+    *fds = malloc(sizeof(int) * MAX_THREADS);
+    if (*fds == NULL) {
+        printf("Thread counter array allocation failed.\n");
+        return 0;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror("Couldn't open /proc/pid/task");
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && num_fds < MAX_THREADS) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0 || tid == pid) {
+            continue;
+        }
+        int fd = setUpProcCycles(tid);
+        if (fd != -1) { // thread may have exited meanwhile
+            (*fds)[num_fds++] = fd;
+        }
+    }
+    closedir(dir);
+    return num_fds;
+}
+
+long long read_thread_counters(int *fds, int num_fds) {
+    long long cycles = 0;
+    for (int i = 0; i < num_fds; i++) {
+        cycles += readInterval(fds[i]);
+    }
+    return cycles;
+}
+
+void close_thread_counters(int *fds, int num_fds) {
+    for (int i = 0; i < num_fds; i++) {
+        closeEvent(fds[i]);
+    }
+    free(fds);
+}
+
+struct thread_table *init_thread_table() {
+    struct thread_table *table = calloc(1, sizeof(struct thread_table));
+    if (table == NULL) {
+        printf("Thread table allocation failed.\n");
+        return NULL;
+    }
+    table->current = malloc(sizeof(struct thread_stats) * MAX_THREADS);
+    table->previous = malloc(sizeof(struct thread_stats) * MAX_THREADS);
+    if (table->current == NULL || table->previous == NULL) {
+        printf("Thread table allocation failed.\n");
+        free_thread_table(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Runtime in ns from schedstat, utime + stime of stat if schedstats are not available
+static int read_thread_runtime(pid_t pid, pid_t tid, unsigned long long *runtime) {
+    char path[96];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", pid, tid);
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        int ret = fscanf(fp, "%llu", runtime);
+        fclose(fp);
+        if (ret == 1) {
+            return 0;
+        }
+    }
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned long utime, stime;
+    int ret = fscanf(fp, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime);
+    fclose(fp);
+    if (ret != 2) {
+        return -1;
+    }
+    *runtime = (unsigned long long) (utime + stime) * 1000000000ULL / sysconf(_SC_CLK_TCK);
+    return 0;
+}
+
+// Walk /proc/pid/task, runtime per thread since the previous walk
+int read_thread_stats(pid_t pid, struct thread_table *table) {
+    char path[96];
+
+    // Last walk becomes the previous one
+    struct thread_stats *swap = table->previous;
+    table->previous = table->current;
+    table->num_previous = table->num_current;
+    table->current = swap;
+    table->num_current = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && table->num_current < MAX_THREADS) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0) {
+            continue;
+        }
+        struct thread_stats *thread = &table->current[table->num_current];
+        memset(thread, 0, sizeof(struct thread_stats));
+        thread->tid = tid;
+        if (read_thread_runtime(pid, tid, &thread->runtime) == -1) {
+            continue; // exited meanwhile
+        }
+        table->num_current++;
+    }
+    closedir(dir);
+    qsort(table->current, table->num_current, sizeof(struct thread_stats), compare_tid);
+
+    // Interval from the previous runtime, the name is only read for new threads
+    for (int i = 0; i < table->num_current; i++) {
+        struct thread_stats *thread = &table->current[i];
+        struct thread_stats *last = bsearch(thread, table->previous, table->num_previous,
+                sizeof(struct thread_stats), compare_tid);
+        if (last != NULL) {
+            thread->runtime_interval = thread->runtime - last->runtime;
+            memcpy(thread->comm, last->comm, sizeof(thread->comm));
+            continue;
+        }
+        thread->runtime_interval = thread->runtime;
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", pid, thread->tid);
+        FILE *fp = fopen(path, "r");
+        if (fp != NULL) {
+            if (fgets(thread->comm, sizeof(thread->comm), fp) != NULL) {
+                thread->comm[strcspn(thread->comm, "\n")] = '\0';
+            }
+            fclose(fp);
+        }
+    }
+    return 0;
+}
+
+// Each thread gets the process cycles and energy times its share of the runtime
+void split_process_counters(struct thread_table *table, long long cycles, long long energy) {
+    unsigned long long runtime = 0;
+    for (int i = 0; i < table->num_current; i++) {
+        runtime += table->current[i].runtime_interval;
+    }
+    for (int i = 0; i < table->num_current; i++) {
+        double share = runtime > 0 ? (double) table->current[i].runtime_interval / runtime : 0;
+        table->current[i].cycles_interval = share * cycles;
+        table->current[i].energy_interval_est = share * energy;
+    }
+}
+
+// Indices of the n threads with the most runtime, returns how many were found
+int top_threads(struct thread_table *table, int *indices, int n) {
+    int found = 0;
+    for (int i = 0; i < table->num_current; i++) {
+        unsigned long long runtime = table->current[i].runtime_interval;
+        int j = found < n ? found++ : n;
+        // insertion into the sorted top n
+        while (j > 0 && table->current[indices[j - 1]].runtime_interval < runtime) {
+            if (j < n) {
+                indices[j] = indices[j - 1];
+            }
+            j--;
+        }
+        if (j < n) {
+            indices[j] = i;
+        }
+    }
+    return found;
+}
+
+void free_thread_table(struct thread_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    free(table->current);
+    free(table->previous);
+    free(table);
+}
@@ -0,0 +1,42 @@
+#ifndef thread_stats_h
+#define thread_stats_h
+
+#include <sys/types.h>
+
+#define MAX_THREADS 4096 // per process, bounds the /proc/pid/task walk and the attach fds
+
+struct thread_stats
+{
+    pid_t tid;
+    char comm[16];
+    unsigned long long runtime; // in nanoseconds on cpu
+    unsigned long long runtime_interval; // in nanoseconds
+    long long cycles_interval; // process cycles split by runtime share
+    long long energy_interval_est; // in microjoules
+};
+
+struct thread_table
+{
+    struct thread_stats *current; // sorted by tid
+    struct thread_stats *previous;
+    int num_current;
+    int num_previous;
+};
+
+int open_thread_counters(pid_t pid, int **fds);
+
+long long read_thread_counters(int *fds, int num_fds);
+
+void close_thread_counters(int *fds, int num_fds);
+
+struct thread_table *init_thread_table();
+
+int read_thread_stats(pid_t pid, struct thread_table *table);
+
+void split_process_counters(struct thread_table *table, long long cycles, long long energy);
+
+int top_threads(struct thread_table *table, int *indices, int n);
+
+void free_thread_table(struct thread_table *table);
+
+#endif